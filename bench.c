@@ -0,0 +1,404 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+/*
+ * rpnbench - time the interpreter's hot paths.
+ *
+ * Each benchmark is run with a growing iteration count until it takes
+ * at least MINTIME seconds, and reported as one JSON object per line:
+ *
+ *	{"bench":"push_pop","iters":33554432,"ns_per_op":2.91,"ops_per_sec":343642780}
+ *
+ * Run it with "make bench" from the source directory, which it needs
+ * for rpn.macros and ./rpn.  Build with the same CFLAGS each time when
+ * comparing runs, e.g. make clean bench CFLAGS=-O2.  Any arguments
+ * select the benchmarks whose names start with them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "rpn.h"
+
+#define MINTIME		0.25
+
+extern __thread struct metastack *M;
+extern __thread FILE *outfp;
+
+static volatile void *sink;
+static volatile double dsink;
+static char **only;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run fn(n), which does n operations, with n doubling until it takes
+ * MINTIME, and report the time per operation.
+ */
+static void
+bench(char *name, void (*fn)(long))
+{
+	long n;
+	double t;
+	char **o;
+
+	if (only && *only) {
+		for (o = only; *o && strncmp(name, *o, strlen(*o)) != 0; o++)
+			;
+		if (*o == NULL)
+			return;
+	}
+
+	for (n = 1;; n *= 2) {
+		t = now();
+		fn(n);
+		if ((t = now() - t) >= MINTIME)
+			break;
+	}
+	printf("{\"bench\":\"%s\",\"iters\":%ld,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f}\n",
+	    name, n, t * 1e9 / n, n / t);
+	fflush(stdout);
+}
+
+/*
+ * The operand stack.
+ */
+
+static void
+b_push_pop(long n)
+{
+	long i, j;
+
+	for (i = 0; i < n; i += 256) {
+		for (j = 0; j < 256; j++)
+			pushnum(j);
+		for (j = 0; j < 256; j++)
+			dsink = popnum();
+	}
+}
+
+/*
+ * Dispatch: resolve the name of every built-in command, as compiling a
+ * line does for each word.  "bsearch" is the sorted table and strcmp
+ * binary search that findcmd() used before the perfect hash.
+ */
+
+#define CMD(name, numargs, function)	{ name, numargs, NULL },
+static struct command sorted[] = {
+#include "commands.h"
+};
+#undef CMD
+#define NUMSORTED (sizeof sorted / sizeof *sorted)
+
+static int
+cmdcmp(const void *cmd, const void *cmdptr)
+{
+	return strcmp(((struct command *)cmd)->name, ((struct command *)cmdptr)->name);
+}
+
+static void
+b_dispatch_bsearch(long n)
+{
+	long i;
+	struct command c;
+
+	for (i = 0; i < n; i++) {
+		c.name = sorted[i % NUMSORTED].name;
+		sink = bsearch(&c, sorted, NUMSORTED, sizeof *sorted, cmdcmp);
+	}
+}
+
+static void
+b_dispatch_findcmd(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++)
+		sink = findcmd(sorted[i % NUMSORTED].name);
+}
+
+/*
+ * findmacro() on macros that exist and on built-in names, which every
+ * command word is looked up as first.
+ */
+
+static char *macronames[] = {
+	"total", "ave", "inv", "over", "bits", "fill", "ihls", "discount",
+	"+", "swap", "dup", "pick", "sin", "repeat", "setbase", "depth"
+};
+#define NUMMACRONAMES (sizeof macronames / sizeof *macronames)
+
+static void
+b_findmacro(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++)
+		sink = findmacro(macronames[i % NUMMACRONAMES]);
+}
+
+/*
+ * Compiling a line: tokenizing, number parsing and name lookup.
+ */
+
+static char line[] = "1 2 + 3.5 * 0x1f swap - 1,000 12e3 dup / ff#16 over sq";
+#define LINEWORDS	15
+
+static void
+b_compile(long n)
+{
+	static struct code c;
+	long i;
+
+	for (i = 0; i < n; i += LINEWORDS) {
+		freecode(&c);
+		compile(line, &c, 0);
+	}
+}
+
+static char *numbers[] = {
+	"0", "1", "42", "-17", "3.14159", "-0.5", "1,234,567", "6.02e23",
+	"1e-9", "0x7fff", "017", "ff#16", "101#2", "12345678.875", "-.25",
+	"0.1"
+};
+#define NUMNUMBERS (sizeof numbers / sizeof *numbers)
+
+static void
+b_parsenum(long n)
+{
+	long i;
+	double num;
+	char word[32];
+
+	for (i = 0; i < n; i++) {
+		strcpy(word, numbers[i % NUMNUMBERS]);
+		parsenum(word, &num);
+		dsink = num;
+	}
+}
+
+/*
+ * Running compiled code.  Each benchmark runs a line that leaves the
+ * stack empty again; one op is one run of it.
+ */
+
+struct line {
+	char *name, *src;
+	struct code code;
+};
+
+static struct line lines[] = {
+	{ "run_arith",	"1 2 + 3 * 4 - 5 / drop" },
+	{ "run_bits",	"0 1 2 3 4 5 6 7 bits drop" },
+	{ "run_bits_word", "64 word 0 1 2 3 4 5 6 7 bits drop 0 word" },
+	{ "run_ave",	"1 2 3 4 5 6 7 8 ave drop" },
+	{ "run_fill",	"100 fill clr" },
+	{ "run_ihls",	"ihls clr" },
+	{ "run_total",	"1000 fill total drop" },
+	{ "run_map",	"1000 fill map sqrt clr" },
+};
+#define NUMLINES (sizeof lines / sizeof *lines)
+
+static struct line *thisline;
+
+static void
+b_run(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++)
+		run(&thisline->code);
+}
+
+/*
+ * printstk() of a deep stack, to /dev/null.  One op is one number.
+ */
+
+#define PRINTDEPTH	100000
+
+static void
+b_printstk(long n)
+{
+	long i;
+
+	clearstack();
+	for (i = 0; i < PRINTDEPTH; i++)
+		pushnum(i * 1.125 / 7);
+	for (i = 0; i < n; i += PRINTDEPTH)
+		printstk("\n");
+	clearstack();
+}
+
+static void
+b_printstk_int(long n)
+{
+	long i;
+
+	clearstack();
+	for (i = 0; i < PRINTDEPTH; i++)
+		pushnum(i * 37);
+	for (i = 0; i < n; i += PRINTDEPTH)
+		printstk("\n");
+	clearstack();
+}
+
+/*
+ * Startup: init_macros() including ~/.rpn_macros, and a whole run of
+ * ./rpn from fork to exit, with the real $HOME and with a copy of
+ * rpn.macros as ~/.rpn_macros, read from its cache or, with the cache
+ * removed first, parsed and cached again.  /bin/true is the floor.
+ */
+
+static void
+b_init_macros(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++) {
+		init_macros();
+		loadmacros("rpn.macros", 0);
+	}
+}
+
+static char home[] = "/tmp/rpnbench.XXXXXX";
+static char macros[sizeof home + 16], cache[sizeof home + 32];
+
+/*
+ * Run argv n times, removing the file stale first each time if it is
+ * not NULL.
+ */
+static void
+spawn(long n, char *const argv[], char *stale)
+{
+	long i;
+	pid_t pid;
+	int status;
+
+	for (i = 0; i < n; i++) {
+		if ((pid = fork()) == 0) {
+			if (stale != NULL)
+				unlink(stale);
+			if (freopen("/dev/null", "w", stdout) == NULL)
+				_exit(127);
+			execv(argv[0], argv);
+			_exit(127);
+		}
+		waitpid(pid, &status, 0);
+	}
+}
+
+static char *rpnargv[] = { "./rpn", "1", NULL };
+
+static void
+b_startup_rpn(long n)
+{
+	spawn(n, rpnargv, NULL);
+}
+
+static void
+b_startup_uncached(long n)
+{
+	spawn(n, rpnargv, cache);
+}
+
+static void
+b_startup_true(long n)
+{
+	char *argv[] = { "/bin/true", NULL };
+
+	spawn(n, argv, NULL);
+}
+
+/*
+ * Make a home for the startup benchmarks with rpn.macros in it.
+ */
+static int
+makehome(void)
+{
+	FILE *in, *out;
+	char buf[BUFSIZ];
+	size_t n;
+
+	if (mkdtemp(home) == NULL)
+		return 0;
+	snprintf(macros, sizeof macros, "%s/.rpn_macros", home);
+	snprintf(cache, sizeof cache, "%s/.rpn_macros.cache", home);
+	if ((in = fopen("rpn.macros", "r")) == NULL) {
+		rmdir(home);
+		return 0;
+	}
+	if ((out = fopen(macros, "w")) == NULL) {
+		fclose(in);
+		rmdir(home);
+		return 0;
+	}
+	while ((n = fread(buf, 1, sizeof buf, in)) > 0)
+		fwrite(buf, 1, n, out);
+	fclose(in);
+	fclose(out);
+	return 1;
+}
+
+static void
+removehome(void)
+{
+	unlink(cache);
+	unlink(macros);
+	rmdir(home);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t i;
+
+	only = argv + 1;
+	(void)argc;
+
+	M = newstack(NULL);
+	if ((outfp = fopen("/dev/null", "w")) == NULL) {
+		perror("/dev/null");
+		return 1;
+	}
+	init_macros();
+	if (!loadmacros("rpn.macros", 0))
+		fputs("rpnbench: no rpn.macros, skipping macros from it\n", stderr);
+	compilemacros();
+
+	bench("push_pop", b_push_pop);
+	bench("dispatch_bsearch", b_dispatch_bsearch);
+	bench("dispatch_findcmd", b_dispatch_findcmd);
+	bench("findmacro", b_findmacro);
+	bench("compile_word", b_compile);
+	bench("parsenum", b_parsenum);
+	for (i = 0; i < NUMLINES; i++) {
+		thisline = &lines[i];
+		compile(thisline->src, &thisline->code, 0);
+		bench(thisline->name, b_run);
+	}
+	bench("printstk_num", b_printstk);
+	bench("printstk_int", b_printstk_int);
+	bench("init_macros", b_init_macros);
+	if (access("./rpn", X_OK) == 0) {
+		bench("startup_rpn", b_startup_rpn);
+		if (makehome()) {
+			setenv("HOME", home, 1);
+			bench("startup_cached", b_startup_rpn);
+			bench("startup_uncached", b_startup_uncached);
+			removehome();
+		}
+	}
+	bench("startup_true", b_startup_true);
+	return 0;
+}
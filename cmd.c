@@ -6,47 +6,59 @@
  * Things to do:
  *	- Arbitrary-precision math
  *	- Variables
- *	- Programming control statements:
- *	  <expression> if <commands> [else] <commands> end
- *	  begin <expression> while <commands> end
- *	  <lower> <upper> for <variable> <commands> next
- *	  <lower> <upper> for <variable> <commands> <n> step
- *	  <lower> <upper> start <commands> next
- *	  <lower> <upper> start <commands> <n> step
- *	  Some sort of do ... until loop
  *	- Complex numbers
- *	- Different word sizes; better integer/real number support
  *	- Polar/rectangular support
  *	- Radian/degrees mode
  *	- Strings (needed to do macro definition stuff)
  *	- Arrays/vectors/matrices
  *	- xroot, combinatorics, time access
  *	- shell escape
- *	- $RPNINIT, ~/.rpnrc, ~/.rpnstk support
+ *	- $RPNINIT, ~/.rpnrc support
  */
 
 #include <math.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
 #include "rpn.h"
-
-int repeat = 1;
-extern int stackmode;
-extern int padcount;
-
-static char *thiscmd;
+#include "hash.h"
+
+__thread int repeat = 1;
+__thread unsigned long nerrors = 0;
+__thread int quiet = 0;		/* count errors without reporting them */
+__thread int serving = 0;	/* for --serve or librpn; quit returns */
+__thread int quitting = 0;	/* and it has run quit */
+extern __thread int stackmode;
+extern __thread int padcount;
+extern __thread int digits;
+extern __thread size_t maxdepth;
+extern __thread size_t memlimit;
+extern int threads;
+extern __thread FILE *outfp;
+
+__thread char *thiscmd;
+unsigned long macrogen = 1;
 static struct macro *macrohead = NULL;
-extern int base, stop;
-extern struct metastack *M;
+extern __thread int base, stop, wordsize, wordsigned;
+extern __thread struct metastack *M;
 
 void
 error(char *msg)
 {
-	printf("Error: %s: %s\n", thiscmd, msg);
+	if (!quiet)
+		fprintf(outfp, "Error: %s: %s\n", thiscmd, msg);
+	nerrors++;
 	stop = 1;
+#ifdef PROFILE
+	profileerror();
+#endif
 }
 
 /*
@@ -56,24 +68,24 @@ error(char *msg)
 static void
 cmd_not(void)
 {
-	top()->num = !top()->num;
+	TOP = !TOP;
 }
 
 static void
 cmd_ne(void)
 {
 	double tmpnum = popnum();
-	top()->num = top()->num != tmpnum;
+	TOP = TOP != tmpnum;
 }
 
 static void
 cmd_mod(void)
 {
-	if (top()->num == 0)
+	if (TOP == 0)
 		error(ERR_DIVBYZERO);
 	else {
 		double tmpnum = popnum();
-		top()->num = fmod(top()->num, tmpnum);
+		TOP = fmod(TOP, tmpnum);
 	}
 }
 
@@ -81,57 +93,57 @@ static void
 cmd_bitand(void)
 {
 	double tmpnum = popnum();
-	top()->num = (unsigned long)top()->num & (unsigned long)tmpnum;
+	TOP = (unsigned long)TOP & (unsigned long)tmpnum;
 }
 
 static void
 cmd_and(void)
 {
 	double tmpnum = popnum();
-	top()->num = top()->num && tmpnum;
+	TOP = TOP && tmpnum;
 }
 
 static void
 cmd_mul(void)
 {
 	double tmpnum = popnum();
-	top()->num *= tmpnum;
+	TOP *= tmpnum;
 }
 
 static void
 cmd_add(void)
 {
 	double tmpnum = popnum();
-	top()->num += tmpnum;
+	TOP += tmpnum;
 }
 
 static void
 cmd_inc(void)
 {
-	top()->num++;
+	TOP++;
 }
 
 static void
 cmd_sub(void)
 {
 	double tmpnum = popnum();
-	top()->num -= tmpnum;
+	TOP -= tmpnum;
 }
 
 static void
 cmd_dec(void)
 {
-	top()->num--;
+	TOP--;
 }
 
 static void
 cmd_div(void)
 {
-	if (top()->num == 0)
+	if (TOP == 0)
 		error(ERR_DIVBYZERO);
 	else {
 		double tmpnum = popnum();
-		top()->num /= tmpnum;
+		TOP /= tmpnum;
 	}
 }
 
@@ -139,106 +151,106 @@ static void
 cmd_lt(void)
 {
 	double tmpnum = popnum();
-	top()->num = top()->num < tmpnum;
+	TOP = TOP < tmpnum;
 }
 
 static void
 cmd_bitshl(void)
 {
 	double tmpnum = popnum();
-	top()->num = (unsigned long)top()->num << (unsigned long)tmpnum;
+	TOP = (unsigned long)TOP << (unsigned long)tmpnum;
 }
 
 static void
 cmd_le(void)
 {
 	double tmpnum = popnum();
-	top()->num = top()->num <= tmpnum;
+	TOP = TOP <= tmpnum;
 }
 
 static void
 cmd_eq(void)
 {
 	double tmpnum = popnum();
-	top()->num = top()->num == tmpnum;
+	TOP = TOP == tmpnum;
 }
 
 static void
 cmd_gt(void)
 {
 	double tmpnum = popnum();
-	top()->num = top()->num > tmpnum;
+	TOP = TOP > tmpnum;
 }
 
 static void
 cmd_ge(void)
 {
 	double tmpnum = popnum();
-	top()->num = top()->num >= tmpnum;
+	TOP = TOP >= tmpnum;
 }
 
 static void
 cmd_bitshr(void)
 {
 	double tmpnum = popnum();
-	top()->num = (unsigned long)top()->num >> (unsigned long)tmpnum;
+	TOP = (unsigned long)TOP >> (unsigned long)tmpnum;
 }
 
 static void
 cmd_bitxor(void)
 {
 	double tmpnum = popnum();
-	top()->num = (unsigned long)top()->num ^ (unsigned long)tmpnum;
+	TOP = (unsigned long)TOP ^ (unsigned long)tmpnum;
 }
 
 /* Someday, this will be a macro */
 static void
 cmd_abs(void)
 {
-	if (top()->num < 0)
-		top()->num = -top()->num;
+	if (TOP < 0)
+		TOP = -TOP;
 }
 
 static void
 cmd_acos(void)
 {
-	if (top()->num < -1 || top()->num > 1)
+	if (TOP < -1 || TOP > 1)
 		error(ERR_DOMAIN);
 	else
-		top()->num = acos(top()->num);
+		TOP = acos(TOP);
 }
 
 static void
 cmd_asin(void)
 {
-	if (top()->num < -1 || top()->num > 1)
+	if (TOP < -1 || TOP > 1)
 		error(ERR_DOMAIN);
 	else
-		top()->num = asin(top()->num);
+		TOP = asin(TOP);
 }
 
 static void
 cmd_atan(void)
 {
-	top()->num = atan(top()->num);
+	TOP = atan(TOP);
 }
 
 static void
 cmd_ceil(void)
 {
-	top()->num = ceil(top()->num);
+	TOP = ceil(TOP);
 }
 
 static void
 cmd_cos(void)
 {
-	top()->num = cos(top()->num);
+	TOP = cos(TOP);
 }
 
 static void
 cmd_cosh(void)
 {
-	top()->num = cosh(top()->num);
+	TOP = cosh(TOP);
 }
 
 static void
@@ -284,46 +296,54 @@ cmd_pad(void) {
 
 static void
 cmd_ipaddr(void) {
-	unsigned addr = top()->num;
+	unsigned addr = TOP;
 	pushnum(((u_char *)&addr)[0]);
 	pushnum(((u_char *)&addr)[1]);
 	pushnum(((u_char *)&addr)[2]);
 	pushnum(((u_char *)&addr)[3]);
 }
 
+static void
+cmd_digits(void)
+{
+	int num = popnum();
+	if (num < 0 || num > 17)
+		error(ERR_DOMAIN);
+	else
+		digits = num;
+}
+
 static void
 cmd_drop(void)
 {
-	free(pop());
+	M->d--;
 }
 
 /* Someday, this will be a macro */
 static void
 cmd_dropn(void)
 {
-	double tmpnum;
-	for (tmpnum = popnum(); tmpnum > 0; tmpnum--)
-		cmd_drop();
+	size_t n = ceil(popnum());
+
+	M->d -= n;
 }
 
 static void
 cmd_dup(void)
 {
-	pushnum(top()->num);
+	pushnum(TOP);
 }
 
 /* Someday, this will be a macro */
 static void
 cmd_dupn(void)
 {
-	double tmpnum, tmpnum2;
-	struct object *obj;
+	size_t n = ceil(popnum());
 
-	tmpnum = tmpnum2 = popnum();
-	for (obj = top(); tmpnum > 1; obj = obj->next, tmpnum--)
-		;
-	for (; tmpnum2 > 0; obj = obj->prev, tmpnum2--)
-		pushnum(obj->num);
+	while (M->room < M->d + n)
+		growstack();
+	memcpy(&M->s[M->d], &M->s[M->d - n], n * sizeof *M->s);
+	M->d += n;
 }
 
 static void
@@ -335,7 +355,7 @@ cmd_e(void)
 static void
 cmd_exp(void)
 {
-	top()->num = exp(top()->num);
+	TOP = exp(TOP);
 }
 
 /* Someday, this will be a macro */
@@ -343,26 +363,26 @@ static void
 cmd_fact(void)
 {
 	double tmpnum;
-	if (top()->num < 0 || modf(top()->num, &tmpnum) != 0)
+	if (TOP < 0 || modf(TOP, &tmpnum) != 0)
 		error(ERR_DOMAIN);
-	else if (top()->num == 0)
-		top()->num = 1;
+	else if (TOP == 0)
+		TOP = 1;
 	else
-		for (tmpnum = top()->num, top()->num = 1; tmpnum > 1; tmpnum--)
-			top()->num *= tmpnum;
+		for (tmpnum = TOP, TOP = 1; tmpnum > 1; tmpnum--)
+			TOP *= tmpnum;
 }
 
 static void
 cmd_floor(void)
 {
-	top()->num = floor(top()->num);
+	TOP = floor(TOP);
 }
 
 static void
 cmd_fp(void)
 {
 	double tmpnum;
-	top()->num = modf(top()->num, &tmpnum);
+	TOP = modf(TOP, &tmpnum);
 }
 
 static void
@@ -374,39 +394,63 @@ cmd_getbase(void)
 static void
 cmd_ip(void)
 {
-	modf(top()->num, &top()->num);
+	modf(TOP, &TOP);
 }
 
 static void
 cmd_ln(void)
 {
-	if (top()->num < 0)
+	if (TOP < 0)
 		error(ERR_DOMAIN);
 	else
-		top()->num = log(top()->num);
+		TOP = log(TOP);
 }
 
 static void
 cmd_log(void)
 {
-	if (top()->num < 0)
+	if (TOP < 0)
 		error(ERR_DOMAIN);
 	else
-		top()->num = log10(top()->num);
+		TOP = log10(TOP);
 }
 
 /* Someday, this will be a macro */
 static void
 cmd_max(void)
 {
-	popobj(top()->num > top()->next->num ? top()->next : top());
+	double tmpnum = popnum();
+	if (tmpnum > TOP)
+		TOP = tmpnum;
 }
 
 /* Someday, this will be a macro */
 static void
 cmd_min(void)
 {
-	popobj(top()->num < top()->next->num ? top()->next : top());
+	double tmpnum = popnum();
+	if (tmpnum < TOP)
+		TOP = tmpnum;
+}
+
+static void
+cmd_maxdepth(void)
+{
+	double num = popnum();
+	if (num < 1)
+		error(ERR_DOMAIN);
+	else
+		maxdepth = num;
+}
+
+static void
+cmd_memlimit(void)
+{
+	double num = popnum();
+	if (!(num >= 0 && num < (double)SIZE_MAX))
+		error(ERR_DOMAIN);
+	else
+		memlimit = num;
 }
 
 static void
@@ -418,37 +462,43 @@ cmd_pi(void)
 static void
 cmd_pick_roll(void)
 {
-	double tmpnum;
-	struct object *obj;
+	double tmpnum, *obj;
+	size_t n;
 
 	if ((tmpnum = popnum()) == 0)
 		return;
 
-	for (obj = top(); tmpnum > 1; obj = obj->next, tmpnum--)
-		;
-	pushnum(obj->num);
-
-	if (strcmp(thiscmd, "roll") == 0)
-		popobj(obj);
+	n = tmpnum > 1 ? ceil(tmpnum) - 1 : 0;
+	if (strcmp(thiscmd, "roll") == 0) {
+		obj = &NTH(n);
+		tmpnum = *obj;
+		memmove(obj, obj + 1, n * sizeof *obj);
+		TOP = tmpnum;
+		if (n >= CHUNK)
+			trimstack();
+	} else
+		pushnum(NTH(n));
 }
 
 static void
 cmd_pow(void)
 {
 	double tmpnum;
-	if ((top()->next->num == 0 && top()->num <= 0) ||
-	    (top()->next->num < 0 && modf(top()->num, &tmpnum) != 0))
+	if ((NTH(1) == 0 && TOP <= 0) ||
+	    (NTH(1) < 0 && modf(TOP, &tmpnum) != 0))
 		error(ERR_DOMAIN);
 	else {
 		tmpnum = popnum();
-		top()->num = pow(top()->num, tmpnum);
+		TOP = pow(TOP, tmpnum);
 	}
 }
 
 static void
 cmd_quit(void)
 {
-	exit(0);
+	if (!serving)
+		exit(0);
+	quitting = stop = 1;
 }
 
 static void
@@ -460,7 +510,7 @@ cmd_rand(void)
 static void
 cmd_repeat(void)
 {
-	if (top()->num <= 0)
+	if (TOP <= 0)
 		error(ERR_DOMAIN);
 	else
 		repeat = popnum();
@@ -469,24 +519,24 @@ cmd_repeat(void)
 static void
 cmd_rolld(void)
 {
-	double tmpnum;
-	struct object *obj, *obj2;
+	double tmpnum, *obj;
+	size_t n;
 
 	if ((tmpnum = popnum()) == 1)
 		return;
 
-	for (obj = pop(), obj2 = top(); tmpnum > 2; obj2 = obj2->next, tmpnum--)
-		;
-	if (obj2 == M->b) {
-		M->b = obj;
-		obj->next = NULL;
-	} else {
-		obj2->next->prev = obj;
-		obj->next = obj2->next;
+	n = tmpnum > 2 ? ceil(tmpnum) - 1 : 1;
+	if (n >= M->d) {
+		pushnum(tmpnum);
+		error(ERR_ARGC);
+		return;
 	}
-	obj2->next = obj;
-	obj->prev = obj2;
-	M->d++;
+	tmpnum = TOP;
+	obj = &NTH(n);
+	memmove(obj + 1, obj, n * sizeof *obj);
+	*obj = tmpnum;
+	if (n >= CHUNK)
+		trimstack();
 }
 
 static void
@@ -503,43 +553,55 @@ cmd_setbase(void)
 static void
 cmd_sign(void)
 {
-	if (top()->num)
-		top()->num = top()->num < 0 ? -1 : 1;
+	if (TOP)
+		TOP = TOP < 0 ? -1 : 1;
 }
 
 static void
 cmd_sin(void)
 {
-	top()->num = sin(top()->num);
+	TOP = sin(TOP);
 }
 
 static void
 cmd_sinh(void)
 {
-	top()->num = sinh(top()->num);
+	TOP = sinh(TOP);
 }
 
 static void
 cmd_sqrt(void)
 {
-	if (top()->num < 0)
+	if (TOP < 0)
 		error(ERR_DOMAIN);
 	else
-		top()->num = sqrt(top()->num);
+		TOP = sqrt(TOP);
 }
 
 static void
 cmd_swap(void)
 {
-	double tmpnum = top()->next->num;
-	top()->next->num = top()->num;
-	top()->num = tmpnum;
+	double tmpnum = NTH(1);
+	NTH(1) = TOP;
+	TOP = tmpnum;
 }
 
 static void
 cmd_tanh(void)
 {
-	top()->num = tanh(top()->num);
+	TOP = tanh(TOP);
+}
+
+static void
+cmd_threads(void)
+{
+	double num = popnum();
+	if (serving)
+		error(ERR_SHARED);
+	else if (!(num >= 1))
+		error(ERR_DOMAIN);
+	else
+		threads = num < MAXTHREADS ? num : MAXTHREADS;
 }
 
 static void
@@ -552,32 +614,1038 @@ static void
 cmd_bitor(void)
 {
 	double tmpnum = popnum();
-	top()->num = (unsigned long)top()->num | (unsigned long)tmpnum;
+	TOP = (unsigned long)TOP | (unsigned long)tmpnum;
 }
 
 static void
 cmd_or(void)
 {
 	double tmpnum = popnum();
-	top()->num = top()->num || tmpnum;
+	TOP = TOP || tmpnum;
 }
 
 static void
 cmd_bitcmpl(void)
 {
-	top()->num = ~(unsigned long)top()->num;
+	TOP = ~(unsigned long)TOP;
 }
 
 static void
-addmacro(char *name, char *operation)
+cmd_popcount(void)
+{
+	unsigned long u = TOP;
+	int n;
+
+	for (n = 0; u != 0; u &= u - 1)
+		n++;
+	TOP = n;
+}
+
+/*
+ * n word and n uword: integer words of n bits, signed or unsigned, or
+ * floating point again for 0.  See word.c.
+ */
+static void
+setwordsize(int sign)
+{
+	double num = popnum();
+
+	if (num != 0 && num != 8 && num != 16 && num != 32 && num != 64)
+		error(ERR_DOMAIN);
+	else
+		setword(num, sign);
+}
+
+static void
+cmd_word(void)
+{
+	setwordsize(1);
+}
+
+static void
+cmd_uword(void)
+{
+	setwordsize(0);
+}
+
+/*
+ * Reductions over the whole stack, or over the top n values for the
+ * commands ending in n.  They walk the stack array once.  Each run of up
+ * to LEAF values goes through LANES independent accumulators, which the
+ * compiler can keep in vector registers.  Longer runs are split where a
+ * power of two times LEAF values ends and combined pairwise, so that
+ * rounding error grows with log n rather than with n.  Since CHUNK is
+ * such a power of two too, reduce() can sum the chunks of a big stack
+ * on the thread pool and combine them to exactly the same result.
+ * smax and smin ignore NaNs unless there is nothing else.
+ */
+
+#define LANES	8
+#define LEAF	256
+
+#define RED_SUM		0
+#define RED_PROD	1
+#define RED_MAX		2
+#define RED_MIN		3
+
+static double
+sumrange(const double *p, size_t n)
+{
+	double acc[LANES] = { 0 }, sum = 0;
+	size_t i, j;
+
+	if (n > LEAF) {
+		for (i = LEAF; i * 2 < n; i *= 2)
+			;
+		return sumrange(p, i) + sumrange(p + i, n - i);
+	}
+	for (i = 0; i + LANES <= n; i += LANES)
+		for (j = 0; j < LANES; j++)
+			acc[j] += p[i + j];
+	for (; i < n; i++)
+		sum += p[i];
+	for (j = LANES / 2; j > 0; j /= 2)
+		for (i = 0; i < j; i++)
+			acc[i] += acc[i + j];
+	return acc[0] + sum;
+}
+
+static double
+prodrange(const double *p, size_t n)
+{
+	double acc[LANES] = { 1, 1, 1, 1, 1, 1, 1, 1 }, prod = 1;
+	size_t i, j;
+
+	if (n > LEAF) {
+		for (i = LEAF; i * 2 < n; i *= 2)
+			;
+		return prodrange(p, i) * prodrange(p + i, n - i);
+	}
+	for (i = 0; i + LANES <= n; i += LANES)
+		for (j = 0; j < LANES; j++)
+			acc[j] *= p[i + j];
+	for (; i < n; i++)
+		prod *= p[i];
+	for (j = LANES / 2; j > 0; j /= 2)
+		for (i = 0; i < j; i++)
+			acc[i] *= acc[i + j];
+	return acc[0] * prod;
+}
+
+static double
+maxrange(const double *p, size_t n)
+{
+	double max = p[0];
+	size_t i;
+
+	for (i = 1; i < n; i++)
+		if (p[i] > max || isnan(max))
+			max = p[i];
+	return max;
+}
+
+static double
+minrange(const double *p, size_t n)
+{
+	double min = p[0];
+	size_t i;
+
+	for (i = 1; i < n; i++)
+		if (p[i] < min || isnan(min))
+			min = p[i];
+	return min;
+}
+
+static double
+reduction(int how, const double *p, size_t n)
+{
+	switch (how) {
+	case RED_SUM:
+		return sumrange(p, n);
+	case RED_PROD:
+		return prodrange(p, n);
+	case RED_MAX:
+		return maxrange(p, n);
+	default:
+		return minrange(p, n);
+	}
+}
+
+/*
+ * Combine the sums or products of n chunks the way sumrange() and
+ * prodrange() combine runs.
+ */
+static double
+tree(int how, double *v, size_t n)
+{
+	size_t h;
+
+	if (n == 1)
+		return v[0];
+	for (h = 1; h * 2 < n; h *= 2)
+		;
+	if (how == RED_SUM)
+		return tree(how, v, h) + tree(how, v + h, n - h);
+	return tree(how, v, h) * tree(how, v + h, n - h);
+}
+
+struct reduce {
+	int how;
+	const double *p;
+	size_t n;
+	double *out;
+	int spilled;
+};
+
+static void
+reducechunk(void *arg, size_t i)
+{
+	struct reduce *r = arg;
+	size_t n = r->n - i * CHUNK < CHUNK ? r->n - i * CHUNK : CHUNK;
+
+	r->out[i] = reduction(r->how, r->p + i * CHUNK, n);
+	if (r->spilled)
+		dropvalues(r->p + i * CHUNK, n);
+}
+
+/*
+ * Reduce n values at p, on the thread pool if there are enough of them,
+ * and a chunk at a time if they are a spilled stack.
+ */
+static double
+reduce(int how, const double *p, size_t n)
+{
+	struct reduce r;
+	size_t i, nchunks = (n + CHUNK - 1) / CHUNK;
+	double *out, v;
+
+	r.spilled = M->fd >= 0 && p == M->s;
+	if ((!bigjob(n) && !r.spilled) || nchunks < 2) {
+		v = reduction(how, p, n);
+		trimstack();
+		return v;
+	}
+	if ((out = malloc(nchunks * sizeof *out)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	r.how = how;
+	r.p = p;
+	r.n = n;
+	r.out = out;
+	if (bigjob(n))
+		poolrun(nchunks, reducechunk, &r);
+	else
+		for (i = 0; i < nchunks; i++)
+			reducechunk(&r, i);
+	v = how == RED_SUM || how == RED_PROD ? tree(how, out, nchunks) :
+	    reduction(how, out, nchunks);
+	free(out);
+	trimstack();
+	return v;
+}
+
+static void
+cmd_sum(void)
 {
-	struct macro *macro, *ptrtmp;
+	M->s[0] = reduce(RED_SUM, M->s, M->d);
+	M->d = 1;
+}
 
-	for (ptrtmp = macrohead; ptrtmp != NULL; ptrtmp = ptrtmp->next) {
-		if (strcmp(name, ptrtmp->name) == 0) {
-			ptrtmp->operation = operation;
+static void
+cmd_sumn(void)
+{
+	size_t n = ceil(popnum());
+
+	M->d -= n;
+	pushnum(reduce(RED_SUM, &M->s[M->d], n));
+}
+
+static void
+cmd_prod(void)
+{
+	M->s[0] = reduce(RED_PROD, M->s, M->d);
+	M->d = 1;
+}
+
+static void
+cmd_mean(void)
+{
+	M->s[0] = reduce(RED_SUM, M->s, M->d) / M->d;
+	M->d = 1;
+}
+
+static void
+cmd_meann(void)
+{
+	size_t n;
+
+	if (TOP < 1) {
+		error(ERR_DOMAIN);
+		return;
+	}
+	n = ceil(popnum());
+	M->d -= n;
+	M->s[M->d] = reduce(RED_SUM, &M->s[M->d], n) / n;
+	M->d++;
+}
+
+static void
+cmd_smax(void)
+{
+	M->s[0] = reduce(RED_MAX, M->s, M->d);
+	M->d = 1;
+}
+
+static void
+cmd_smin(void)
+{
+	M->s[0] = reduce(RED_MIN, M->s, M->d);
+	M->d = 1;
+}
+
+/*
+ * Ordering the stack.  Values are ordered by their bits turned into
+ * unsigned keys, which sort as the doubles do: negative numbers have all
+ * their bits flipped and the rest just the sign bit.  -0 sorts before 0,
+ * and nan, whatever its sign, after everything.  sort and rsort radix
+ * sort the keys a byte at a time, skipping bytes that are the same in
+ * every key, and median, pct and nth find the values they need by
+ * quickselect on the keys, in linear time on average, without sorting.
+ * The keys are made in place in the stack array and turned back into
+ * values afterwards.  In word mode the keys are the words' bits, with
+ * the sign bit flipped for signed words, and the two values median and
+ * pct take between are worked out on the keys, rounded down.
+ */
+
+#define NANKEY		UINT64_MAX
+#define SIGNBIT		((uint64_t)1 << 63)
+#define RADIXMIN	64		/* smaller stacks get insertion sort */
+
+/* a key over the stack array, which holds doubles */
+typedef uint64_t sortkey __attribute__((__may_alias__));
+
+static sortkey *
+tokeys(void)
+{
+	sortkey *a = (sortkey *)M->s;
+	uint64_t u;
+	size_t i;
+
+	if (wordsize != 0) {
+		if (wordsigned)
+			for (i = 0; i < M->d; i++)
+				a[i] ^= SIGNBIT;
+		return a;
+	}
+	for (i = 0; i < M->d; i++) {
+		u = a[i];
+		if ((u & ~SIGNBIT) > 0x7ff0000000000000ULL)
+			a[i] = NANKEY;
+		else
+			a[i] = u & SIGNBIT ? ~u : u | SIGNBIT;
+	}
+	return a;
+}
+
+static double
+fromkey(uint64_t k)
+{
+	double v;
+
+	if (wordsize != 0) {
+		if (wordsigned)
+			k ^= SIGNBIT;
+		memcpy(&v, &k, sizeof v);
+		return v;
+	}
+	if (k == NANKEY)
+		return NAN;
+	k = k & SIGNBIT ? k & ~SIGNBIT : ~k;
+	memcpy(&v, &k, sizeof v);
+	return v;
+}
+
+static void
+fromkeys(sortkey *a, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		M->s[i] = fromkey(a[i]);
+	trimstack();
+}
+
+static void
+insertsort(sortkey *a, size_t n)
+{
+	size_t i, j;
+	uint64_t k;
+
+	for (i = 1; i < n; i++) {
+		k = a[i];
+		for (j = i; j > 0 && a[j - 1] > k; j--)
+			a[j] = a[j - 1];
+		a[j] = k;
+	}
+}
+
+static void
+radixsort(sortkey *a, size_t n)
+{
+	size_t count[8][256] = { { 0 } }, i, pos, c;
+	sortkey *tmp, *from = a, *to, *t;
+	int b;
+
+	if (n < RADIXMIN) {
+		insertsort(a, n);
+		return;
+	}
+	if ((tmp = malloc(n * sizeof *tmp)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		for (b = 0; b < 8; b++)
+			count[b][a[i] >> (b * 8) & 0xff]++;
+	to = tmp;
+	for (b = 0; b < 8; b++) {
+		if (count[b][from[0] >> (b * 8) & 0xff] == n)
+			continue;
+		for (i = pos = 0; i < 256; i++) {
+			c = count[b][i];
+			count[b][i] = pos;
+			pos += c;
+		}
+		for (i = 0; i < n; i++)
+			to[count[b][from[i] >> (b * 8) & 0xff]++] = from[i];
+		t = from;
+		from = to;
+		to = t;
+	}
+	if (from != a)
+		memcpy(a, from, n * sizeof *a);
+	free(tmp);
+}
+
+/*
+ * Reorder a[0..n) so that a[k] is what it would be sorted, with nothing
+ * greater before it and nothing less after it.  A range that does not
+ * shrink fast enough is sorted instead.
+ */
+static void
+selectkey(sortkey *a, size_t n, size_t k)
+{
+	ptrdiff_t lo = 0, hi = n - 1, i, j;
+	uint64_t p, t;
+	int budget = 128;
+
+	while (lo < hi) {
+		if (budget-- == 0) {
+			radixsort(a + lo, hi - lo + 1);
+			return;
+		}
+		i = lo + (hi - lo) / 2;
+		p = a[lo] < a[i] ? (a[i] < a[hi] ? a[i] :
+		    a[lo] < a[hi] ? a[hi] : a[lo]) :
+		    (a[lo] < a[hi] ? a[lo] : a[i] < a[hi] ? a[hi] : a[i]);
+		i = lo;
+		j = hi;
+		while (i <= j) {
+			while (a[i] < p)
+				i++;
+			while (a[j] > p)
+				j--;
+			if (i <= j) {
+				t = a[i];
+				a[i++] = a[j];
+				a[j--] = t;
+			}
+		}
+		if ((ptrdiff_t)k <= j)
+			hi = j;
+		else if ((ptrdiff_t)k >= i)
+			lo = i;
+		else
 			return;
+	}
+}
+
+/*
+ * The smallest key in a[0..n), after selectkey() has put the one before
+ * it in place.
+ */
+static uint64_t
+minkey(sortkey *a, size_t n)
+{
+	uint64_t min = a[0];
+	size_t i;
+
+	for (i = 1; i < n; i++)
+		if (a[i] < min)
+			min = a[i];
+	return min;
+}
+
+/*
+ * The key a fraction f of the way from key k to the greater key k2, for
+ * pct in word mode.
+ */
+static uint64_t
+keystep(uint64_t k, uint64_t k2, double f)
+{
+	double x = (double)(k2 - k) * f;
+
+	return x >= (double)(k2 - k) ? k2 : k + (uint64_t)x;
+}
+
+static void
+cmd_sort(void)
+{
+	sortkey *a = tokeys();
+
+	radixsort(a, M->d);
+	fromkeys(a, M->d);
+}
+
+static void
+cmd_rsort(void)
+{
+	sortkey *a = tokeys();
+	uint64_t t;
+	size_t i, n = M->d;
+
+	radixsort(a, n);
+	for (i = 0; i < n / 2; i++) {
+		t = a[i];
+		a[i] = a[n - 1 - i];
+		a[n - 1 - i] = t;
+	}
+	fromkeys(a, n);
+}
+
+static void
+cmd_median(void)
+{
+	size_t n = M->d, k = (n - 1) / 2;
+	sortkey *a = tokeys();
+	uint64_t k2;
+	double v;
+
+	selectkey(a, n, k);
+	v = fromkey(a[k]);
+	if (n % 2 == 0) {
+		k2 = minkey(a + k + 1, n - k - 1);
+		if (wordsize != 0)
+			v = fromkey(a[k] + (k2 - a[k]) / 2);
+		else
+			v = (v + fromkey(k2)) / 2;
+	}
+	M->s[0] = v;
+	M->d = 1;
+	trimstack();
+}
+
+/*
+ * N pct: the Nth percentile, between the two nearest values in order
+ * when it falls between them.
+ */
+static void
+cmd_pct(void)
+{
+	double p, rank, f, v;
+	sortkey *a;
+	uint64_t k2;
+	size_t n, k;
+
+	if (!(TOP >= 0 && TOP <= 100)) {
+		error(ERR_DOMAIN);
+		return;
+	}
+	p = popnum();
+	n = M->d;
+	rank = p / 100 * (n - 1);
+	k = floor(rank);
+	f = rank - k;
+	a = tokeys();
+	selectkey(a, n, k);
+	v = fromkey(a[k]);
+	if (f > 0) {
+		k2 = minkey(a + k + 1, n - k - 1);
+		if (wordsize != 0)
+			v = fromkey(keystep(a[k], k2, f));
+		else
+			v += (fromkey(k2) - v) * f;
+	}
+	M->s[0] = v;
+	M->d = 1;
+	trimstack();
+}
+
+/*
+ * N nth: the Nth smallest value.
+ */
+static void
+cmd_nth(void)
+{
+	sortkey *a;
+	size_t k;
+
+	if (TOP < 1 || TOP > M->d - 1 || TOP != floor(TOP)) {
+		error(ERR_DOMAIN);
+		return;
+	}
+	k = popnum() - 1;
+	a = tokeys();
+	selectkey(a, M->d, k);
+	M->s[0] = fromkey(a[k]);
+	M->d = 1;
+	trimstack();
+}
+
+/*
+ * One-pass statistics.  A struct moments holds the count, mean, sums of
+ * squared and cubed deviations from the mean, and the least and greatest
+ * values of a set, and two sets combine with addmoments() by the
+ * parallel formulas of Chan et al.  momentrange() runs Welford's update
+ * in LANES independent lanes, each taking every LANES-th value, so that
+ * the lanes of a row all share a count and the compiler can keep them in
+ * vector registers, and then combines the lanes.  moments() does each
+ * CHUNK of values that way and combines the chunks in order, on the
+ * thread pool for a big stack, so the result is the same either way, and
+ * the same again when rpn -c streams a column through it a CHUNK at a
+ * time.  The least and greatest ignore NaNs unless there is nothing
+ * else.
+ */
+
+void
+addmoments(struct moments *a, const struct moments *b)
+{
+	double n, d, dn;
+
+	if (b->n == 0)
+		return;
+	if (a->n == 0) {
+		*a = *b;
+		return;
+	}
+	n = a->n + b->n;
+	d = b->mean - a->mean;
+	dn = d / n;
+	a->m3 += b->m3 + d * dn * dn * a->n * b->n * (a->n - b->n) +
+	    3 * dn * (a->n * b->m2 - b->n * a->m2);
+	a->m2 += b->m2 + d * dn * a->n * b->n;
+	a->mean += dn * b->n;
+	if (b->min < a->min || isnan(a->min))
+		a->min = b->min;
+	if (b->max > a->max || isnan(a->max))
+		a->max = b->max;
+	a->n = n;
+}
+
+static void
+momentrange(struct moments *m, const double *p, size_t n)
+{
+	double mean[LANES] = { 0 }, m2[LANES] = { 0 }, m3[LANES] = { 0 };
+	double min[LANES], max[LANES], x, k, d, dn, t;
+	struct moments lane;
+	size_t i, j, rows = n / LANES;
+
+	m->n = m->mean = m->m2 = m->m3 = 0;
+	m->min = m->max = NAN;
+	for (j = 0; j < LANES; j++)
+		min[j] = max[j] = NAN;
+	for (i = 0; i < rows; i++) {
+		k = i + 1;
+		for (j = 0; j < LANES; j++) {
+			x = p[i * LANES + j];
+			d = x - mean[j];
+			dn = d / k;
+			t = d * dn * (k - 1);
+			m3[j] += t * dn * (k - 2) - 3 * dn * m2[j];
+			m2[j] += t;
+			mean[j] += dn;
+			if (x < min[j] || isnan(min[j]))
+				min[j] = x;
+			if (x > max[j] || isnan(max[j]))
+				max[j] = x;
+		}
+	}
+	for (j = 0; rows > 0 && j < LANES; j++) {
+		lane.n = rows;
+		lane.mean = mean[j];
+		lane.m2 = m2[j];
+		lane.m3 = m3[j];
+		lane.min = min[j];
+		lane.max = max[j];
+		addmoments(m, &lane);
+	}
+	for (i = rows * LANES; i < n; i++) {
+		lane.n = 1;
+		lane.mean = lane.min = lane.max = p[i];
+		lane.m2 = lane.m3 = 0;
+		addmoments(m, &lane);
+	}
+}
+
+struct momentjob {
+	const double *p;
+	size_t n;
+	struct moments *out;
+	int spilled;
+};
+
+static void
+momentchunk(void *arg, size_t i)
+{
+	struct momentjob *j = arg;
+	size_t n = j->n - i * CHUNK < CHUNK ? j->n - i * CHUNK : CHUNK;
+
+	momentrange(&j->out[i], j->p + i * CHUNK, n);
+	if (j->spilled)
+		dropvalues(j->p + i * CHUNK, n);
+}
+
+/*
+ * The moments of the n values at p.
+ */
+void
+moments(struct moments *m, const double *p, size_t n)
+{
+	struct momentjob j;
+	size_t i, nchunks = (n + CHUNK - 1) / CHUNK;
+
+	if (nchunks < 2) {
+		momentrange(m, p, n);
+		trimstack();
+		return;
+	}
+	if ((j.out = malloc(nchunks * sizeof *j.out)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	j.p = p;
+	j.n = n;
+	j.spilled = M->fd >= 0 && p == M->s;
+	if (bigjob(n))
+		poolrun(nchunks, momentchunk, &j);
+	else
+		for (i = 0; i < nchunks; i++)
+			momentchunk(&j, i);
+	*m = j.out[0];
+	for (i = 1; i < nchunks; i++)
+		addmoments(m, &j.out[i]);
+	free(j.out);
+	trimstack();
+}
+
+static double
+variance(struct moments *m)
+{
+	return m->n > 1 ? m->m2 / (m->n - 1) : NAN;
+}
+
+static double
+skewness(struct moments *m)
+{
+	return m->n > 1 && m->m2 > 0 ? sqrt(m->n) * m->m3 / pow(m->m2, 1.5) : NAN;
+}
+
+/*
+ * Push what describe leaves: count, mean, sample variance and standard
+ * deviation, skewness, least and greatest.
+ */
+void
+pushmoments(struct moments *m)
+{
+	pushnum(m->n);
+	pushnum(m->n > 0 ? m->mean : NAN);
+	pushnum(variance(m));
+	pushnum(sqrt(variance(m)));
+	pushnum(skewness(m));
+	pushnum(m->min);
+	pushnum(m->max);
+}
+
+static void
+cmd_var(void)
+{
+	struct moments m;
+
+	moments(&m, M->s, M->d);
+	if (m.n < 2) {
+		error(ERR_DOMAIN);
+		return;
+	}
+	M->s[0] = variance(&m);
+	M->d = 1;
+}
+
+static void
+cmd_sdev(void)
+{
+	struct moments m;
+
+	moments(&m, M->s, M->d);
+	if (m.n < 2) {
+		error(ERR_DOMAIN);
+		return;
+	}
+	M->s[0] = sqrt(variance(&m));
+	M->d = 1;
+}
+
+static void
+cmd_skew(void)
+{
+	struct moments m;
+
+	moments(&m, M->s, M->d);
+	if (m.n < 2 || !(m.m2 > 0)) {
+		error(ERR_DOMAIN);
+		return;
+	}
+	M->s[0] = skewness(&m);
+	M->d = 1;
+}
+
+static void
+cmd_describe(void)
+{
+	struct moments m;
+
+	moments(&m, M->s, M->d);
+	M->d = 0;
+	pushmoments(&m);
+}
+
+/*
+ * N hist: replace the stack with how many of its values fall in each of
+ * N equal bins from the least value to the greatest, lowest bin first.
+ * It takes two passes over the stack, since the bins cannot be placed
+ * until the range is known: one finds the least and greatest and a
+ * second bins the values, each a chunk at a time on the thread pool for
+ * a big stack, so hist reads the stack twice where sum reads it once,
+ * from its file both times if it has spilled.  Each thread counts into
+ * bins of its own, which are added up at the end.  NaNs are left out.
+ * Infinities leave no range to divide, so they are a domain error.
+ */
+
+#define MAXBINS		(1 << 20)
+
+struct histjob {
+	const double *p;
+	size_t n, nbins;
+	double lo, scale;
+	double *los, *his;	/* the range of each chunk */
+	pthread_mutex_t lock;
+	struct {
+		pthread_t tid;
+		size_t *count;
+	} tally[MAXTHREADS];	/* one per thread that takes a chunk */
+	int ntallies;
+	int spilled;
+};
+
+static void
+rangechunk(void *arg, size_t c)
+{
+	struct histjob *j = arg;
+	size_t end = (c + 1) * CHUNK < j->n ? (c + 1) * CHUNK : j->n, i;
+	double x, lo = NAN, hi = NAN;
+
+	for (i = c * CHUNK; i < end; i++) {
+		x = j->p[i];
+		if (x < lo || isnan(lo))
+			lo = x;
+		if (x > hi || isnan(hi))
+			hi = x;
+	}
+	j->los[c] = lo;
+	j->his[c] = hi;
+	if (j->spilled)
+		dropvalues(j->p + c * CHUNK, end - c * CHUNK);
+}
+
+/*
+ * The bins of the calling thread, made the first time it needs them.
+ */
+static size_t *
+histcount(struct histjob *j)
+{
+	pthread_t self = pthread_self();
+	size_t *count = NULL;
+	int i;
+
+	pthread_mutex_lock(&j->lock);
+	for (i = 0; i < j->ntallies && count == NULL; i++)
+		if (pthread_equal(j->tally[i].tid, self))
+			count = j->tally[i].count;
+	if (count == NULL) {
+		if ((count = calloc(j->nbins, sizeof *count)) == NULL) {
+			perror("Error: calloc");
+			exit(1);
 		}
+		j->tally[j->ntallies].tid = self;
+		j->tally[j->ntallies++].count = count;
+	}
+	pthread_mutex_unlock(&j->lock);
+	return count;
+}
+
+static void
+histchunk(void *arg, size_t c)
+{
+	struct histjob *j = arg;
+	size_t *count = histcount(j), i;
+	size_t end = (c + 1) * CHUNK < j->n ? (c + 1) * CHUNK : j->n;
+	double x, f;
+
+	for (i = c * CHUNK; i < end; i++) {
+		x = j->p[i];
+		if (isnan(x))
+			continue;
+		f = (x * 0.5 - j->lo) * j->scale;
+		count[f < j->nbins ? (size_t)f : j->nbins - 1]++;
+	}
+	if (j->spilled)
+		dropvalues(j->p + c * CHUNK, end - c * CHUNK);
+}
+
+static void
+cmd_hist(void)
+{
+	struct histjob j;
+	size_t i, c, nchunks, *count;
+	double hi;
+	int t;
+
+	if (TOP < 1 || TOP > MAXBINS || TOP != floor(TOP)) {
+		error(ERR_DOMAIN);
+		return;
+	}
+	j.p = M->s;
+	j.n = M->d - 1;
+	j.spilled = M->fd >= 0;
+	nchunks = (j.n + CHUNK - 1) / CHUNK;
+	if ((j.los = malloc(2 * (nchunks + 1) * sizeof *j.los)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	j.his = j.los + nchunks + 1;
+	if (bigjob(j.n))
+		poolrun(nchunks, rangechunk, &j);
+	else
+		for (c = 0; c < nchunks; c++)
+			rangechunk(&j, c);
+	j.lo = hi = NAN;
+	for (c = 0; c < nchunks; c++) {
+		if (j.los[c] < j.lo || isnan(j.lo))
+			j.lo = j.los[c];
+		if (j.his[c] > hi || isnan(hi))
+			hi = j.his[c];
+	}
+	free(j.los);
+	if (isinf(j.lo) || isinf(hi)) {
+		error(ERR_DOMAIN);
+		return;
+	}
+
+	/* halved, so that the range of any two doubles is finite */
+	j.nbins = popnum();
+	j.lo *= 0.5;
+	j.scale = hi * 0.5 > j.lo ? j.nbins / (hi * 0.5 - j.lo) : 0;
+	pthread_mutex_init(&j.lock, NULL);
+	j.ntallies = 0;
+	count = histcount(&j);
+	if (bigjob(j.n))
+		poolrun(nchunks, histchunk, &j);
+	else
+		for (c = 0; c < nchunks; c++)
+			histchunk(&j, c);
+	for (t = 1; t < j.ntallies; t++) {
+		for (i = 0; i < j.nbins; i++)
+			count[i] += j.tally[t].count[i];
+		free(j.tally[t].count);
+	}
+	pthread_mutex_destroy(&j.lock);
+	while (M->room < j.nbins)
+		growstack();
+	for (i = 0; i < j.nbins; i++)
+		M->s[i] = count[i];
+	M->d = j.nbins;
+	free(count);
+	trimstack();
+}
+
+/*
+ * Open-addressed hash table of pointers to structures whose first member
+ * is their name.  size is a power of two and the table is kept at most
+ * half full, so probe sequences stay short.
+ */
+struct symtab {
+	void **slot;
+	size_t size, used;
+};
+
+#define SYMNAME(p)	(*(char **)(p))
+
+static void *
+symfind(struct symtab *tab, const char *name)
+{
+	size_t i, mask = tab->size - 1;
+
+	if (tab->size == 0)
+		return NULL;
+	for (i = hashstr(name, 0) & mask; tab->slot[i] != NULL; i = (i + 1) & mask)
+		if (strcmp(SYMNAME(tab->slot[i]), name) == 0)
+			return tab->slot[i];
+	return NULL;
+}
+
+static void
+symadd(struct symtab *tab, void *sym)
+{
+	size_t i, mask;
+
+	if ((tab->used + 1) * 2 > tab->size) {
+		struct symtab n;
+
+		n.size = tab->size ? tab->size * 2 : 64;
+		n.used = 0;
+		if ((n.slot = calloc(n.size, sizeof *n.slot)) == NULL) {
+			perror("Error: calloc");
+			exit(1);
+		}
+		for (i = 0; i < tab->size; i++)
+			if (tab->slot[i] != NULL)
+				symadd(&n, tab->slot[i]);
+		free(tab->slot);
+		*tab = n;
+	}
+
+	mask = tab->size - 1;
+	for (i = hashstr(SYMNAME(sym), 0) & mask; tab->slot[i] != NULL; i = (i + 1) & mask)
+		;
+	tab->slot[i] = sym;
+	tab->used++;
+}
+
+/*
+ * Macros live in macrotab for lookup and on the macrohead list, newest
+ * first, for listing.
+ */
+static struct symtab macrotab;
+
+void
+addmacro(char *name, char *operation)
+{
+	struct macro *macro;
+
+	if ((macro = symfind(&macrotab, name)) != NULL) {
+		macro->operation = operation;
+		macrogen++;
+		return;
 	}
 
 	if ((macro = malloc(sizeof *macro)) == NULL) {
@@ -586,6 +1654,11 @@ addmacro(char *name, char *operation)
 	}
 	macro->name = name;
 	macro->operation = operation;
+	macro->code.ops = NULL;
+	macro->code.n = macro->code.room = 0;
+	macro->gen = 0;
+	macrogen++;
+	symadd(&macrotab, macro);
 
 	if (macrohead == NULL) {
 		macrohead = macro;
@@ -598,16 +1671,37 @@ addmacro(char *name, char *operation)
 	}
 }
 
-char *
+struct macro *
 findmacro(char *name)
+{
+	return symfind(&macrotab, name);
+}
+
+/*
+ * Compile every stale macro now, so that threads running them never
+ * need to.
+ */
+void
+compilemacros(void)
 {
 	struct macro *macro;
 
 	for (macro = macrohead; macro != NULL; macro = macro->next)
-		if (strcmp(macro->name, name) == 0)
-			return macro->operation;
+		if (macro->gen != macrogen)
+			compilemacro(macro);
+}
 
-	return NULL;
+/*
+ * Bodies are compiled when first run rather than in addmacro(), since
+ * they may use macros that are defined further down ~/.rpn_macros.
+ */
+void
+compilemacro(struct macro *macro)
+{
+	freecode(&macro->code);
+	compile(macro->operation, &macro->code, 0);
+	macro->leaf = isleaf(&macro->code);
+	macro->gen = macrogen;
 }
 
 void
@@ -615,7 +1709,7 @@ init_macros(void)
 {
 	char *env = getenv("HOME");
 
-	addmacro("total", "depth -- repeat +");
+	addmacro("total", "sum");
 	addmacro("tan", "dup sin swap cos /");
 	addmacro("sq", "2 pow");
 	addmacro("sec", "cos inv");
@@ -633,113 +1727,86 @@ init_macros(void)
 	addmacro("clr", "depth dropn");
 	addmacro("chs", "-1 *");
 	addmacro("bin", "2 setbase");
-	addmacro("aven", "dup -- swap depth rolld repeat + depth roll /");
-	addmacro("ave", "depth aven");
+	addmacro("aven", "meann");
+	addmacro("ave", "mean");
 	addmacro("alog", "10 swap pow");
 	addmacro("?", "help");
 
 	if (env) {
 	    char buf[10240];
-	    FILE *fp;
-	    sprintf(buf, "%s/.rpn_macros", env);
+	    snprintf(buf, sizeof buf, "%s/.rpn_macros", env);
+	    loadmacros(buf, getenv("RPN_NOCACHE") == NULL);
+	}
+}
 
-	    fp = fopen(buf, "r");
-	    if (fp) {
-		while (fgets(buf, sizeof(buf), fp) != NULL) {
-		    if(buf[0] == '#')
+/*
+ * Read macro definitions, one "name body" per line, from path.  With
+ * cache, use the cache of path that readcache() keeps if it is up to
+ * date, and make it again if not.
+ */
+int
+loadmacros(char *path, int cache)
+{
+	char buf[10240], *p, *name, *body, **defs = NULL;
+	size_t ndefs = 0, room = 0;
+	struct stat st;
+	FILE *fp;
+
+	if (cache && readcache(path))
+		return 1;
+	if ((fp = fopen(path, "r")) == NULL)
+		return 0;
+	if (fstat(fileno(fp), &st) < 0)
+		cache = 0;
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		if(buf[0] == '#')
 			continue;
 
-		    char *p = buf;
-		    while (*p && *p != ' ') p++;
-		    if (*p) {
+		p = buf;
+		while (*p && *p != ' ') p++;
+		if (*p) {
 			*p++ = 0;
-			addmacro(strdup(buf), strdup(p));
-		    }
+			name = strdup(buf);
+			body = strdup(p);
+			addmacro(name, body);
+			if (!cache)
+				continue;
+			if (ndefs == room) {
+				room = room ? room * 2 : 64;
+				if ((defs = realloc(defs, 2 * room * sizeof *defs)) == NULL) {
+					perror("Error: realloc");
+					exit(1);
+				}
+			}
+			defs[2 * ndefs] = name;
+			defs[2 * ndefs++ + 1] = body;
 		}
-	    }
 	}
+	fclose(fp);
+	if (cache)
+		writecache(path, &st, defs, ndefs);
+	free(defs);
+	return 1;
 }
 
 /*
- * commands[] is sorted for the binary search in findcmd().
+ * _commands[] is built from commands.h.  findcmd() finds built-ins
+ * through the perfect hash that mkhash generates from the same file into
+ * cmdhash.h; commands added at run time go in cmdtab instead.
  */
 
-static void cmd_help(void);
+static void cmd_help(void), cmd_stats(void);
 static struct command _commands[] = {
-	{ "!",		1,	cmd_not		},
-	{ "!=",		2,	cmd_ne		},
-	{ "%",		2,	cmd_mod		},
-	{ "&",		2,	cmd_bitand	},
-	{ "&&",		2,	cmd_and		},
-	{ "*",		2,	cmd_mul		},
-	{ "+",		2,	cmd_add		},
-	{ "++",		1,	cmd_inc		},
-	{ "-",		2,	cmd_sub		},
-	{ "--",		1,	cmd_dec		},
-	{ "/",		2,	cmd_div		},
-	{ "<",		2,	cmd_lt		},
-	{ "<<",		2,	cmd_bitshl	},
-	{ "<=",		2,	cmd_le		},
-	{ "==",		2,	cmd_eq		},
-	{ ">",		2,	cmd_gt		},
-	{ ">=",		2,	cmd_ge		},
-	{ ">>",		2,	cmd_bitshr	},
-	{ "^",		2,	cmd_bitxor	},
-	{ "abs",	1,	cmd_abs		},
-	{ "acos",	1,	cmd_acos	},
-	{ "asin",	1,	cmd_asin	},
-	{ "atan",	1,	cmd_atan	},
-	{ "ceil",	1,	cmd_ceil	},
-	{ "cos",	1,	cmd_cos		},
-	{ "cosh",	1,	cmd_cosh	},
-	{ "depth",	0,	cmd_depth	},
-	{ "drop",	1,	cmd_drop	},
-	{ "dropn",	-1,	cmd_dropn	},
-	{ "dup",	1,	cmd_dup		},
-	{ "dupn",	-1,	cmd_dupn	},
-	{ "e",		0,	cmd_e		},
-	{ "exp",	1,	cmd_exp		},
-	{ "fact",	1,	cmd_fact	},
-	{ "floor",	1,	cmd_floor	},
-	{ "fp",		1,	cmd_fp		},
-	{ "getbase",	0,	cmd_getbase	},
-	{ "help",	0,	cmd_help	},
-	{ "hnl",	1, 	cmd_htonl	},
-	{ "hns",	1, 	cmd_htons	},
-	{ "ip",		1,	cmd_ip		},
-	{ "ipaddr",	1,	cmd_ipaddr	},
-	{ "ln",		1,	cmd_ln		},
-	{ "log",	1,	cmd_log		},
-	{ "max",	2,	cmd_max		},
-	{ "min",	2,	cmd_min		},
-	{ "nhl",	1, 	cmd_ntohl	},
-	{ "nhs",	1, 	cmd_ntohs	},
-	{ "pad",	1,	cmd_pad		},
-	{ "pi",		0,	cmd_pi		},
-	{ "pick",	-1,	cmd_pick_roll	},
-	{ "pow",	2,	cmd_pow		},
-	{ "quit",	0,	cmd_quit	},
-	{ "rand",	0,	cmd_rand	},
-	{ "repeat",	1,	cmd_repeat	},
-	{ "roll",	-1,	cmd_pick_roll	},
-	{ "rolld",	-1,	cmd_rolld	},
-	{ "setbase",	1,	cmd_setbase	},
-	{ "sign",	1,	cmd_sign	},
-	{ "sin",	1,	cmd_sin		},
-	{ "sinh",	1,	cmd_sinh	},
-	{ "sqrt",	1,	cmd_sqrt	},
-	{ "stack",	0,      cmd_stack	},
-	{ "swap",	2,	cmd_swap	},
-	{ "tanh",	1,	cmd_tanh	},
-	{ "version",	0,	cmd_version	},
-	{ "|",		2,	cmd_bitor	},
-	{ "||",		2,	cmd_or		},
-	{ "~",		1,	cmd_bitcmpl	}
+#define CMD(name, numargs, function)	{ name, numargs, function },
+#include "commands.h"
+#undef CMD
 };
 #define NUMCMDS (sizeof _commands / sizeof *_commands)
-static struct command *commands = _commands;
-static size_t numcmds = NUMCMDS;
-static size_t roomcmds = 0;
+#include "cmdhash.h"
+
+static struct symtab cmdtab;
+static struct command **addedcmds = NULL;
+static size_t numadded = 0;
 
 static void
 cmd_help(void)
@@ -747,70 +1814,144 @@ cmd_help(void)
 	int x;
 	struct macro *macro;
 
-	puts("\nStandard commands:");
-	for (x = 0; x < NUMCMDS; x++) {
-		printf("%8s", commands[x].name);
+	fputs("\nStandard commands:\n", outfp);
+	for (x = 0; x < NUMCMDS + numadded; x++) {
+		fprintf(outfp, "%8s", x < NUMCMDS ? _commands[x].name : addedcmds[x - NUMCMDS]->name);
 		if (x % 9 == 8)
-			putchar('\n');
+			putc('\n', outfp);
 	}
 	if (x % 9)
-		puts("\n");
+		fputs("\n\n", outfp);
 	else
-		putchar('\n');
+		putc('\n', outfp);
 
 	if (macrohead != NULL) {
-		puts("Macros:");
+		fputs("Macros:\n", outfp);
 		for (macro = macrohead, x = 0; macro != NULL; macro = macro->next) {
 			if(macro->name[0] == '$')
 				continue;
 
-			printf("%8s", macro->name);
+			fprintf(outfp, "%8s", macro->name);
 			if (x++ % 9 == 8)
-				putchar('\n');
+				putc('\n', outfp);
 		}
 		if (x % 9)
-			puts("\n");
+			fputs("\n\n", outfp);
 		else
-			putchar('\n');
+			putc('\n', outfp);
 	}
 }
 
+#ifdef PROFILE
+struct statrow {
+	char *name;
+	struct prof *p;
+};
+
 static int
-cmdcmp(const void *cmd, const void *cmdptr)
+statcmp(const void *a, const void *b)
 {
-	return strcmp(((struct command *)cmd)->name, ((struct command *)cmdptr)->name);
+	const struct statrow *x = a, *y = b;
+
+	if (x->p->self != y->p->self)
+		return x->p->self < y->p->self ? 1 : -1;
+	return strcmp(x->name, y->name);
 }
 
+/*
+ * Print the commands and macros that have run, most self time first.
+ */
+static void
+printstats(FILE *fp)
+{
+	struct statrow *rows;
+	struct macro *macro;
+	size_t x, n = 0;
+
+	for (macro = macrohead; macro != NULL; macro = macro->next)
+		n++;
+	if ((rows = malloc((NUMCMDS + numadded + n) * sizeof *rows)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	n = 0;
+	for (x = 0; x < NUMCMDS; x++)
+		if (_commands[x].prof.calls) {
+			rows[n].name = _commands[x].name;
+			rows[n++].p = &_commands[x].prof;
+		}
+	for (x = 0; x < numadded; x++)
+		if (addedcmds[x]->prof.calls) {
+			rows[n].name = addedcmds[x]->name;
+			rows[n++].p = &addedcmds[x]->prof;
+		}
+	for (macro = macrohead; macro != NULL; macro = macro->next)
+		if (macro->prof.calls) {
+			rows[n].name = macro->name;
+			rows[n++].p = &macro->prof;
+		}
+	qsort(rows, n, sizeof *rows, statcmp);
+
+	fprintf(fp, "%12s %8s %12s %12s  %s\n",
+	    "calls", "errors", "total ms", "self ms", "name");
+	for (x = 0; x < n; x++)
+		fprintf(fp, "%12lu %8lu %12.3f %12.3f  %s\n",
+		    rows[x].p->calls, rows[x].p->errors,
+		    rows[x].p->total / 1e6, rows[x].p->self / 1e6, rows[x].name);
+	free(rows);
+}
 
 static void
-cmdrefresh(void) {
-	qsort(commands, numcmds, sizeof *commands, cmdcmp);
+cmd_stats(void)
+{
+	printstats(outfp);
 }
 
+/*
+ * Registered with atexit() when $RPN_STATS is set.
+ */
+void
+dumpstats(void)
+{
+	fflush(outfp);
+	printstats(stderr);
+}
+#else
+static void
+cmd_stats(void)
+{
+	error(ERR_NOPROFILE);
+}
+
+void
+dumpstats(void)
+{
+	fputs("rpn: RPN_STATS needs a build with -DPROFILE\n", stderr);
+}
+#endif
+
 void
 addcommand(struct command *c) {
-	if(!roomcmds) {
-		struct command *ca = malloc((numcmds * 2) * sizeof *commands);
-		memcpy(ca, commands, numcmds * sizeof *commands);
-		if(commands != _commands)
-			free(commands);
+	struct command *cmdptr, **added;
 
-		commands = ca;
-		roomcmds = numcmds;
+	if ((cmdptr = malloc(sizeof *cmdptr)) == NULL ||
+	    (added = realloc(addedcmds, (numadded + 1) * sizeof *added)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
 	}
-
-	commands[numcmds] = *c;
-	numcmds++;
-	roomcmds--;
-	cmdrefresh();
+	*cmdptr = *c;
+	symadd(&cmdtab, cmdptr);
+	addedcmds = added;
+	addedcmds[numadded++] = cmdptr;
+	macrogen++;
 }
 
 struct command *
 findcmd(char *cmd)
 {
-	struct command c;
-	c.name = cmd;
-	thiscmd = cmd;
+	unsigned x = cmdhash[hashstr(cmd, CMDHASH_SEED) & (CMDHASH_SIZE - 1)];
 
-	return bsearch(&c, commands, numcmds, sizeof *commands, cmdcmp);
+	if (x != 0 && strcmp(_commands[x - 1].name, cmd) == 0)
+		return &_commands[x - 1];
+	return symfind(&cmdtab, cmd);
 }
@@ -0,0 +1,109 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+/*
+ * Built-in commands: CMD(name, numargs, function).
+ *
+ * This file is included by cmd.c to build _commands[] and by mkhash.c,
+ * which generates the perfect hash that findcmd() uses, so it must hold
+ * nothing but CMD() lines and comments.  A numargs of -1 means the top
+ * of the stack holds the number of arguments below it.
+ */
+
+CMD("!",	1,	cmd_not)
+CMD("!=",	2,	cmd_ne)
+CMD("%",	2,	cmd_mod)
+CMD("&",	2,	cmd_bitand)
+CMD("&&",	2,	cmd_and)
+CMD("*",	2,	cmd_mul)
+CMD("+",	2,	cmd_add)
+CMD("++",	1,	cmd_inc)
+CMD("-",	2,	cmd_sub)
+CMD("--",	1,	cmd_dec)
+CMD("/",	2,	cmd_div)
+CMD("<",	2,	cmd_lt)
+CMD("<<",	2,	cmd_bitshl)
+CMD("<=",	2,	cmd_le)
+CMD("==",	2,	cmd_eq)
+CMD(">",	2,	cmd_gt)
+CMD(">=",	2,	cmd_ge)
+CMD(">>",	2,	cmd_bitshr)
+CMD("^",	2,	cmd_bitxor)
+CMD("abs",	1,	cmd_abs)
+CMD("acos",	1,	cmd_acos)
+CMD("asin",	1,	cmd_asin)
+CMD("atan",	1,	cmd_atan)
+CMD("ceil",	1,	cmd_ceil)
+CMD("cos",	1,	cmd_cos)
+CMD("cosh",	1,	cmd_cosh)
+CMD("depth",	0,	cmd_depth)
+CMD("describe",	1,	cmd_describe)
+CMD("digits",	1,	cmd_digits)
+CMD("drop",	1,	cmd_drop)
+CMD("dropn",	-1,	cmd_dropn)
+CMD("dup",	1,	cmd_dup)
+CMD("dupn",	-1,	cmd_dupn)
+CMD("e",	0,	cmd_e)
+CMD("exp",	1,	cmd_exp)
+CMD("fact",	1,	cmd_fact)
+CMD("floor",	1,	cmd_floor)
+CMD("fp",	1,	cmd_fp)
+CMD("getbase",	0,	cmd_getbase)
+CMD("help",	0,	cmd_help)
+CMD("hist",	2,	cmd_hist)
+CMD("hnl",	1,	cmd_htonl)
+CMD("hns",	1,	cmd_htons)
+CMD("ip",	1,	cmd_ip)
+CMD("ipaddr",	1,	cmd_ipaddr)
+CMD("ln",	1,	cmd_ln)
+CMD("log",	1,	cmd_log)
+CMD("max",	2,	cmd_max)
+CMD("maxdepth",	1,	cmd_maxdepth)
+CMD("mean",	1,	cmd_mean)
+CMD("meann",	-1,	cmd_meann)
+CMD("median",	1,	cmd_median)
+CMD("memlimit",	1,	cmd_memlimit)
+CMD("min",	2,	cmd_min)
+CMD("nhl",	1,	cmd_ntohl)
+CMD("nhs",	1,	cmd_ntohs)
+CMD("nth",	2,	cmd_nth)
+CMD("pad",	1,	cmd_pad)
+CMD("pct",	2,	cmd_pct)
+CMD("pi",	0,	cmd_pi)
+CMD("pick",	-1,	cmd_pick_roll)
+CMD("popcount",	1,	cmd_popcount)
+CMD("pops",	0,	popstack)
+CMD("pow",	2,	cmd_pow)
+CMD("prod",	1,	cmd_prod)
+CMD("pushs",	0,	pushstack)
+CMD("quit",	0,	cmd_quit)
+CMD("rand",	0,	cmd_rand)
+CMD("repeat",	1,	cmd_repeat)
+CMD("roll",	-1,	cmd_pick_roll)
+CMD("rolld",	-1,	cmd_rolld)
+CMD("rsort",	0,	cmd_rsort)
+CMD("sdev",	1,	cmd_sdev)
+CMD("setbase",	1,	cmd_setbase)
+CMD("sign",	1,	cmd_sign)
+CMD("sin",	1,	cmd_sin)
+CMD("sinh",	1,	cmd_sinh)
+CMD("skew",	1,	cmd_skew)
+CMD("smax",	1,	cmd_smax)
+CMD("smin",	1,	cmd_smin)
+CMD("sort",	0,	cmd_sort)
+CMD("sqrt",	1,	cmd_sqrt)
+CMD("stack",	0,	cmd_stack)
+CMD("stats",	0,	cmd_stats)
+CMD("sum",	1,	cmd_sum)
+CMD("sumn",	-1,	cmd_sumn)
+CMD("swap",	2,	cmd_swap)
+CMD("tanh",	1,	cmd_tanh)
+CMD("threads",	1,	cmd_threads)
+CMD("uword",	1,	cmd_uword)
+CMD("var",	1,	cmd_var)
+CMD("version",	0,	cmd_version)
+CMD("word",	1,	cmd_word)
+CMD("|",	2,	cmd_bitor)
+CMD("||",	2,	cmd_or)
+CMD("~",	1,	cmd_bitcmpl)
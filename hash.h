@@ -0,0 +1,25 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+#include <stdint.h>
+
+/*
+ * String hash shared by cmd.c and mkhash.c: FNV-1a started from seed,
+ * then the murmur3 finalizer so that the low bits can be used as a
+ * table index directly.
+ */
+static inline uint32_t
+hashstr(const char *s, uint32_t seed)
+{
+	uint32_t h = 2166136261U ^ seed;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619U;
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
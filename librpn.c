@@ -0,0 +1,311 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+/*
+ * librpn: contexts over the per-thread interpreter.
+ *
+ * The interpreter keeps its stack and settings in thread-local variables,
+ * which is what lets -j and --serve run it on many threads.  A context
+ * holds a set of them, and each call swaps the context's set into the
+ * calling thread and back out again afterwards, so a context can move
+ * between threads and a thread can use many contexts.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rpn.h"
+#include "librpn.h"
+
+extern __thread struct metastack *M;
+extern __thread FILE *outfp;
+extern __thread int base, stop, stackmode, padcount, digits, repeat;
+extern __thread int serving, quitting, wordsize, wordsigned;
+extern __thread size_t maxdepth, memlimit;
+extern __thread unsigned long nerrors;
+
+struct rpn {
+	struct metastack *m;
+	int base, stackmode, padcount, digits, wordsize, wordsigned;
+	size_t maxdepth, memlimit;
+	FILE *out;
+	char *text;		/* what the last run printed */
+	size_t textlen;
+};
+
+struct rpn_prog {
+	struct code code;
+};
+
+/*
+ * The calling thread's own settings while a context is in.
+ */
+struct saved {
+	struct metastack *m;
+	FILE *outfp;
+	int base, stop, stackmode, padcount, digits, repeat, serving;
+	int wordsize, wordsigned;
+	size_t maxdepth, memlimit;
+};
+
+static void
+enter(rpn *r, struct saved *sv)
+{
+	sv->m = M;
+	sv->outfp = outfp;
+	sv->base = base;
+	sv->stop = stop;
+	sv->stackmode = stackmode;
+	sv->padcount = padcount;
+	sv->digits = digits;
+	sv->repeat = repeat;
+	sv->serving = serving;
+	sv->wordsize = wordsize;
+	sv->wordsigned = wordsigned;
+	sv->maxdepth = maxdepth;
+	sv->memlimit = memlimit;
+
+	M = r->m;
+	outfp = r->out;
+	base = r->base;
+	stackmode = r->stackmode;
+	padcount = r->padcount;
+	digits = r->digits;
+	wordsize = r->wordsize;
+	wordsigned = r->wordsigned;
+	maxdepth = r->maxdepth;
+	memlimit = r->memlimit;
+	stop = quitting = 0;
+	repeat = 1;
+	serving = 1;
+}
+
+static void
+leave(rpn *r, struct saved *sv)
+{
+	r->m = M;
+	r->base = base;
+	r->stackmode = stackmode;
+	r->padcount = padcount;
+	r->digits = digits;
+	r->wordsize = wordsize;
+	r->wordsigned = wordsigned;
+	r->maxdepth = maxdepth;
+	r->memlimit = memlimit;
+
+	M = sv->m;
+	outfp = sv->outfp;
+	base = sv->base;
+	stop = sv->stop;
+	stackmode = sv->stackmode;
+	padcount = sv->padcount;
+	digits = sv->digits;
+	repeat = sv->repeat;
+	serving = sv->serving;
+	wordsize = sv->wordsize;
+	wordsigned = sv->wordsigned;
+	maxdepth = sv->maxdepth;
+	memlimit = sv->memlimit;
+}
+
+static FILE *
+openout(rpn *r)
+{
+	if ((r->out = open_memstream(&r->text, &r->textlen)) == NULL) {
+		perror("Error: open_memstream");
+		exit(1);
+	}
+	return r->out;
+}
+
+/*
+ * Load the built-in macros and ~/.rpn_macros, as rpn does, and then
+ * those in macrofile if it is not NULL, and compile them all.  Returns
+ * 0 if macrofile cannot be read.
+ */
+int
+rpn_init(const char *macrofile)
+{
+	char *path;
+	int ok = 1;
+
+	init_macros();
+	if (macrofile != NULL) {
+		if ((path = strdup(macrofile)) == NULL) {
+			perror("Error: strdup");
+			exit(1);
+		}
+		ok = loadmacros(path, 0);
+		free(path);
+	}
+	compilemacros();
+	return ok;
+}
+
+rpn *
+rpn_new(void)
+{
+	rpn *r;
+
+	if ((r = malloc(sizeof *r)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	r->m = newstack(NULL);
+	r->base = DEFBASE;
+	r->stackmode = r->padcount = 0;
+	r->digits = DEFDIGITS;
+	r->wordsize = 0;
+	r->wordsigned = 1;
+	r->maxdepth = MAXDEPTH;
+	r->memlimit = 0;
+	openout(r);
+	return r;
+}
+
+void
+rpn_free(rpn *r)
+{
+	struct saved sv;
+
+	enter(r, &sv);
+	clearstack();
+	freestack(M);
+	leave(r, &sv);
+	fclose(r->out);
+	free(r->text);
+	free(r);
+}
+
+/*
+ * Compile src, with its control structures closed at its end and
+ * nothing carried over from earlier compiles.  Errors in it are
+ * reported when it runs.
+ */
+rpn_prog *
+rpn_compile(const char *src)
+{
+	rpn_prog *p;
+	char *s;
+
+	if ((p = malloc(sizeof *p)) == NULL || (s = strdup(src)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	p->code.ops = NULL;
+	p->code.n = p->code.room = 0;
+	resetcompile();
+	compile(s, &p->code, 0);
+	free(s);
+	return p;
+}
+
+void
+rpn_freeprog(rpn_prog *p)
+{
+	freecode(&p->code);
+	free(p->code.ops);
+	free(p);
+}
+
+int
+rpn_run(rpn *r, const rpn_prog *p)
+{
+	struct saved sv;
+	unsigned long errs = nerrors;
+
+	if (r->textlen > 0) {
+		fclose(r->out);
+		free(r->text);
+		openout(r);
+	}
+	enter(r, &sv);
+	run((struct code *)&p->code);
+	leave(r, &sv);
+	fflush(r->out);
+	return nerrors - errs;
+}
+
+int
+rpn_eval(rpn *r, const char *src)
+{
+	rpn_prog *p = rpn_compile(src);
+	int n = rpn_run(r, p);
+
+	rpn_freeprog(p);
+	return n;
+}
+
+size_t
+rpn_batch(rpn *r, const rpn_prog *p, size_t nin, const double *const *in,
+    size_t nout, double *const *out, size_t nrows)
+{
+	struct saved sv;
+	size_t nbad;
+
+	enter(r, &sv);
+	nbad = batch((struct code *)&p->code, nin, in, nout, out, nrows);
+	leave(r, &sv);
+	return nbad;
+}
+
+void
+rpn_push(rpn *r, double num)
+{
+	struct saved sv;
+
+	enter(r, &sv);
+	pushnum(wordsize != 0 ? numtoword(num) : num);
+	leave(r, &sv);
+}
+
+/*
+ * Pop the top of the stack into *num.  Returns 0 if it is empty.
+ */
+int
+rpn_pop(rpn *r, double *num)
+{
+	struct saved sv;
+
+	if (r->m->d == 0)
+		return 0;
+	enter(r, &sv);
+	*num = popnum();
+	if (wordsize != 0)
+		*num = wordtonum(*num);
+	leave(r, &sv);
+	return 1;
+}
+
+void
+rpn_clear(rpn *r)
+{
+	struct saved sv;
+
+	enter(r, &sv);
+	clearstack();
+	leave(r, &sv);
+}
+
+size_t
+rpn_depth(const rpn *r)
+{
+	return r->m->d;
+}
+
+/*
+ * The stack, bottom first, until the context next runs or changes.  In
+ * word mode it holds words, which rpn_pop() turns into numbers.
+ */
+const double *
+rpn_stack(const rpn *r)
+{
+	return r->m->s;
+}
+
+const char *
+rpn_output(const rpn *r)
+{
+	return r->textlen > 0 ? r->text : "";
+}
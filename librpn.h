@@ -0,0 +1,73 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+/*
+ * librpn: the rpn evaluator as a library.
+ *
+ * Call rpn_init() once, before anything else, to load the macros; the
+ * command and macro tables do not change after it and are shared by
+ * every context without locking.  A context is an operand stack and the
+ * settings (base, digits and so on) that go with it.  Any number of
+ * contexts may be used at once from different threads, but each one by
+ * one thread at a time.  A program compiled by rpn_compile() may be run
+ * on any context, from any number of threads at once.  memlimit is kept
+ * per context, but the thread pool that big stacks are worked on is the
+ * process's, so threads, which would resize it, is refused in one.
+ *
+ * rpn_run() and rpn_eval() return the number of errors, and whatever
+ * the program printed, errors included, is kept until the next run for
+ * rpn_output().  quit stops the program but not the caller.
+ *
+ * rpn_batch() runs a program over nrows rows given as nin input columns,
+ * each row starting on an empty stack with its values pushed in column
+ * order, and writes the nout values each row leaves to nout output
+ * columns.  Programs of arithmetic, math functions and stack shuffling
+ * run down the columns in blocks of rows; others run row by row.  It
+ * returns how many rows failed or left some other number of values,
+ * which are nan in every output column.  Rows start in floating point,
+ * whatever mode the context is in, and the context's stack is not
+ * touched.
+ *
+ * A context in integer word mode (see "word" in the README) keeps
+ * words on its stack; rpn_push() and rpn_pop() convert numbers to and
+ * from them.
+ */
+
+#ifndef LIBRPN_H
+#define LIBRPN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct rpn rpn;
+typedef struct rpn_prog rpn_prog;
+
+int rpn_init(const char *macrofile);
+
+rpn *rpn_new(void);
+void rpn_free(rpn *);
+
+rpn_prog *rpn_compile(const char *src);
+void rpn_freeprog(rpn_prog *);
+int rpn_run(rpn *, const rpn_prog *);
+int rpn_eval(rpn *, const char *src);
+size_t rpn_batch(rpn *, const rpn_prog *, size_t nin,
+    const double *const *in, size_t nout, double *const *out,
+    size_t nrows);
+
+void rpn_push(rpn *, double);
+int rpn_pop(rpn *, double *);
+void rpn_clear(rpn *);
+size_t rpn_depth(const rpn *);
+const double *rpn_stack(const rpn *);
+const char *rpn_output(const rpn *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,178 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+/*
+ * A cache of ~/.rpn_macros, so that starting rpn does not read and parse
+ * it line by line.
+ *
+ * The cache sits next to the file it was made from, with ".cache"
+ * added to its name, and holds the definitions as they were parsed: a
+ * struct cachehdr, then a name and a body offset for each definition,
+ * in file order, then the strings they point to.  readcache() maps it
+ * and adds the definitions with their strings left in the mapping, which
+ * is never unmapped.  The header records the size, modification time
+ * and inode of the file, and a cache that does not match them is
+ * ignored and written again from the file.  Compiled code holds
+ * pointers to commands and macros, so it is not cached; macros are
+ * compiled when first run, as before.  RPN_NOCACHE in the environment
+ * turns the cache off.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "rpn.h"
+
+#define MAGIC		"rpnmacro"
+#define CACHEVERSION	1
+
+struct cachehdr {
+	char magic[8];
+	uint32_t version, size;		/* size of the header */
+	uint64_t srcsize, srcino;
+	int64_t srcsec, srcnsec;	/* modification time */
+	uint32_t ndefs, strsize;	/* definitions and string bytes */
+};
+
+static char *
+cachepath(char *path)
+{
+	char *p;
+
+	if ((p = malloc(strlen(path) + sizeof ".cache.XXXXXX")) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	sprintf(p, "%s.cache", path);
+	return p;
+}
+
+static int
+matches(struct cachehdr *h, struct stat *st)
+{
+	return h->srcsize == (uint64_t)st->st_size &&
+	    h->srcino == (uint64_t)st->st_ino &&
+	    h->srcsec == st->st_mtim.tv_sec &&
+	    h->srcnsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * Add the definitions cached for the macro file path.  Returns 0 if
+ * there is no cache for it as it is now.
+ */
+int
+readcache(char *path)
+{
+	struct cachehdr *h;
+	struct stat st, cst;
+	uint32_t *defs, i;
+	char *cache, *map, *strs;
+	int fd;
+
+	if (stat(path, &st) < 0)
+		return 0;
+	cache = cachepath(path);
+	fd = open(cache, O_RDONLY);
+	free(cache);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &cst) < 0 || (size_t)cst.st_size < sizeof *h ||
+	    (map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+	    MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	h = (struct cachehdr *)map;
+	defs = (uint32_t *)(map + sizeof *h);
+	strs = (char *)(defs + 2 * (size_t)h->ndefs);
+	if (memcmp(h->magic, MAGIC, sizeof h->magic) != 0 ||
+	    h->version != CACHEVERSION || h->size != sizeof *h ||
+	    !matches(h, &st) ||
+	    (size_t)cst.st_size != sizeof *h + 2 * (size_t)h->ndefs *
+	    sizeof *defs + h->strsize ||
+	    (h->strsize > 0 && strs[h->strsize - 1] != '\0')) {
+		munmap(map, cst.st_size);
+		return 0;
+	}
+	for (i = 0; i < 2 * h->ndefs; i++)
+		if (defs[i] >= h->strsize) {
+			munmap(map, cst.st_size);
+			return 0;
+		}
+	for (i = 0; i < h->ndefs; i++)
+		addmacro(strs + defs[2 * i], strs + defs[2 * i + 1]);
+	return 1;
+}
+
+/*
+ * Cache the n definitions, names and bodies in turn at defs, read from
+ * the macro file path when it was as st describes.  Failing to is not
+ * an error; the file is just read again next time.  Nothing is tried in
+ * a directory that cannot be written, such as a read-only $HOME.
+ */
+void
+writecache(char *path, struct stat *st, char **defs, size_t n)
+{
+	struct cachehdr h;
+	uint32_t *offs;
+	size_t i, len, strsize = 0;
+	char *cache, *tmp, *buf, *p;
+	int fd, ok;
+
+	if ((p = strrchr(path, '/')) != NULL) {
+		*p = '\0';
+		ok = access(p == path ? "/" : path, W_OK) == 0;
+		*p = '/';
+		if (!ok)
+			return;
+	}
+	for (i = 0; i < 2 * n; i++)
+		strsize += strlen(defs[i]) + 1;
+	if (n > UINT32_MAX / 2 || strsize > UINT32_MAX)
+		return;
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, MAGIC, sizeof h.magic);
+	h.version = CACHEVERSION;
+	h.size = sizeof h;
+	h.srcsize = st->st_size;
+	h.srcino = st->st_ino;
+	h.srcsec = st->st_mtim.tv_sec;
+	h.srcnsec = st->st_mtim.tv_nsec;
+	h.ndefs = n;
+	h.strsize = strsize;
+
+	len = sizeof h + 2 * n * sizeof *offs + strsize;
+	if ((buf = malloc(len)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	memcpy(buf, &h, sizeof h);
+	offs = (uint32_t *)(buf + sizeof h);
+	p = (char *)(offs + 2 * n);
+	for (i = 0; i < 2 * n; i++) {
+		offs[i] = p - (char *)(offs + 2 * n);
+		p = stpcpy(p, defs[i]) + 1;
+	}
+
+	cache = cachepath(path);
+	tmp = cachepath(path);
+	strcat(tmp, ".XXXXXX");
+	if ((fd = mkstemp(tmp)) >= 0) {
+		ok = write(fd, buf, len) == (ssize_t)len;
+		if (close(fd) < 0 || !ok || rename(tmp, cache) < 0)
+			unlink(tmp);
+	}
+	free(tmp);
+	free(cache);
+	free(buf);
+}
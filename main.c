@@ -0,0 +1,248 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "rpn.h"
+
+#define OUTBUFSIZE	(1 << 20)
+
+extern __thread struct metastack *M;
+extern __thread FILE *outfp;
+extern __thread size_t memlimit;
+extern size_t defmemlimit;
+
+static void
+init(void) {
+	char *env, *end;
+	double num;
+
+	srand(time(NULL));
+	init_macros();
+	M = newstack(NULL);
+	outfp = stdout;
+	if (getenv("RPN_STATS") != NULL)
+		atexit(dumpstats);
+	if ((env = getenv("RPN_MEMLIMIT")) != NULL) {
+		num = strtod(env, &end);
+		switch (end > env ? *end : '\0') {
+		case 'g': case 'G':
+			num *= 1024;
+			/* FALLTHROUGH */
+		case 'm': case 'M':
+			num *= 1024;
+			/* FALLTHROUGH */
+		case 'k': case 'K':
+			num *= 1024;
+			end++;
+		}
+		if (end == env || *end != '\0' ||
+		    !(num >= 0 && num < (double)SIZE_MAX))
+			fprintf(stderr, "rpn: ignoring RPN_MEMLIMIT=%s\n", env);
+		else
+			memlimit = defmemlimit = num;
+	}
+}
+
+static void
+usage(void)
+{
+	fputs("usage: rpn [--stack file] [expression ...]\n"
+	      "       rpn -e expression [-v] [-j jobs] [file ...]\n"
+	      "       rpn -e expression -b columns [--binary] [-v] [file ...]\n"
+	      "       rpn -c column [-v] [file ...]\n"
+	      "       rpn --serve socket [-j workers]\n"
+	      "       rpn --client socket [expression ...]\n", stderr);
+	exit(2);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *expr = NULL, *stackfile = NULL, *server = NULL, *sock = NULL;
+	int verbose = 0, jobs = 0, col = 0, ncols = 0, binary = 0, x;
+
+	init();
+
+	/*
+	 * Options must come first and are matched exactly, so that
+	 * negative numbers still work as expressions.
+	 */
+	for (x = 1; x < argc; x++) {
+		if (strcmp(argv[x], "-e") == 0) {
+			if (++x == argc)
+				usage();
+			expr = argv[x];
+		} else if (strcmp(argv[x], "-c") == 0) {
+			if (++x == argc || (col = atoi(argv[x])) < 1)
+				usage();
+		} else if (strcmp(argv[x], "-b") == 0) {
+			if (++x == argc || (ncols = atoi(argv[x])) < 1)
+				usage();
+		} else if (strcmp(argv[x], "--binary") == 0)
+			binary = 1;
+		else if (strcmp(argv[x], "-j") == 0) {
+			if (++x == argc || (jobs = atoi(argv[x])) < 1)
+				usage();
+		} else if (strcmp(argv[x], "--stack") == 0) {
+			if (++x == argc)
+				usage();
+			stackfile = argv[x];
+		} else if (strcmp(argv[x], "--serve") == 0) {
+			if (++x == argc)
+				usage();
+			server = argv[x];
+		} else if (strcmp(argv[x], "--client") == 0) {
+			if (++x == argc)
+				usage();
+			sock = argv[x];
+		} else if (strcmp(argv[x], "-v") == 0)
+			verbose = 1;
+		else
+			break;
+	}
+
+	if (server != NULL) {
+		if (x < argc || expr != NULL || col > 0 || sock != NULL ||
+		    stackfile != NULL || verbose || ncols > 0 || binary)
+			usage();
+		return serve(server, jobs);
+	} else if (sock != NULL) {
+		char *line;
+		size_t len = 1;
+		int i;
+
+		if (expr != NULL || col > 0 || jobs != 0 ||
+		    stackfile != NULL || verbose || ncols > 0 || binary)
+			usage();
+		if (x == argc)
+			return client(sock, NULL);
+		for (i = x; i < argc; i++)
+			len += strlen(argv[i]) + 1;
+		if ((line = malloc(len)) == NULL) {
+			perror("Error: malloc");
+			exit(1);
+		}
+		for (*line = '\0'; x < argc; x++) {
+			strcat(line, argv[x]);
+			strcat(line, x + 1 < argc ? " " : "\n");
+		}
+		return client(sock, line);
+	} else if (col > 0) {
+		struct moments m = { 0, 0, 0, 0, NAN, NAN };
+		unsigned long count = 0;
+		double t = now();
+		FILE *fp;
+
+		if (expr != NULL || jobs != 0 || stackfile != NULL ||
+		    ncols > 0 || binary)
+			usage();
+		if (x == argc)
+			count = column(col, stdin, &m);
+		for (; x < argc; x++) {
+			if ((fp = fopen(argv[x], "r")) == NULL) {
+				perror(argv[x]);
+				continue;
+			}
+			count += column(col, fp, &m);
+			fclose(fp);
+		}
+		column(col, NULL, &m);
+		pushmoments(&m);
+		printstk("\n");
+		if (verbose) {
+			t = now() - t;
+			fprintf(stderr, "%lu records in %.3f s, %.0f records/s\n",
+			    count, t, t > 0 ? count / t : 0);
+		}
+		return 0;
+	} else if (expr != NULL) {
+		static struct code prog;
+		unsigned long count = 0, nbad = 0;
+		double t = now();
+		FILE *fp;
+
+		if (stackfile != NULL || (ncols > 0 && jobs != 0) ||
+		    (binary && ncols == 0))
+			usage();
+		compile(expr, &prog, 0);
+		setvbuf(stdout, NULL, _IOFBF, OUTBUFSIZE);
+		if (x == argc)
+			count = ncols > 0 ? table(&prog, ncols, binary, stdin, &nbad) :
+			    records(&prog, stdin, jobs);
+		for (; x < argc; x++) {
+			if ((fp = fopen(argv[x], "r")) == NULL) {
+				perror(argv[x]);
+				continue;
+			}
+			count += ncols > 0 ? table(&prog, ncols, binary, fp, &nbad) :
+			    records(&prog, fp, jobs);
+			fclose(fp);
+		}
+		if (ncols > 0)
+			table(&prog, ncols, binary, NULL, &nbad);
+		fflush(stdout);
+		if (nbad > 0)
+			fprintf(stderr, "rpn: failed for %lu row%s, now nan\n",
+			    nbad, nbad == 1 ? "" : "s");
+		if (verbose) {
+			t = now() - t;
+			fprintf(stderr, "%lu records in %.3f s, %.0f records/s\n",
+			    count, t, t > 0 ? count / t : 0);
+		}
+		return 0;
+	} else if (verbose || jobs != 0 || ncols > 0 || binary)
+		usage();
+
+	/*
+	 * With --stack the stack starts as the one saved in the file, if
+	 * there is one, in the mode it was saved in, and is saved back to
+	 * it at the end.
+	 */
+	if (stackfile != NULL && access(stackfile, F_OK) == 0)
+		loadstack(stackfile, 1);
+
+	if (x < argc) {
+		for (; x < argc; x++)
+			process(argv[x]);
+		process(NULL);
+		if (stackfile != NULL)
+			savestack(stackfile);
+		printstk("\n");
+	} else {
+		int interactive = isatty(0);
+		char *buf = NULL;
+		size_t room = 0;
+		if (interactive)
+			printstk("> ");
+		while (getline(&buf, &room, stdin) != -1) {
+			process(buf);
+			if (interactive)
+				printstk("> ");
+		}
+		free(buf);
+		process(NULL);
+		if (stackfile != NULL)
+			savestack(stackfile);
+		if (!interactive)
+			printstk("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,714 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+/*
+ * map NAME: run a macro or command over every value on the stack.
+ *
+ * Each value goes through NAME by itself, as if it were alone on the
+ * stack, and is replaced by whatever NAME leaves there.  When NAME, and
+ * every macro it calls, is straight-line arithmetic, math functions and
+ * stack shuffling, it is flattened into a lane program and run over
+ * BATCH values at a time.  The lane stack holds a column of BATCH values
+ * per level, so each op is one loop down its columns, which the
+ * compiler can vectorize.  A value that fails a domain check only has
+ * its lane flagged.  Anything else, and everything in word mode, runs
+ * through run() one value at a time.  Either way a value that fails
+ * becomes a single nan, or 0 in word mode, and one error at the end
+ * says how many did.
+ *
+ * batch() runs an expression the same way over rows of several values
+ * given as columns.  Each row starts in floating point.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "rpn.h"
+
+#define BATCH		256	/* lanes run together */
+#define LANEDEPTH	16	/* deepest lane stack */
+#define LANENEST	16	/* deepest macro call flattened */
+
+extern __thread struct metastack *M;
+extern __thread int quiet;
+extern __thread int wordsize, wordsigned;
+extern __thread char *thiscmd;
+extern __thread unsigned long nerrors;
+extern unsigned long macrogen;
+
+#define L_NUM	0	/* push k */
+#define L_PICK	1	/* k pick */
+#define L_ROLL	2	/* k roll */
+#define L_DUP	3
+#define L_SWAP	4
+#define L_DROP	5
+#define L_ADD	6
+#define L_SUB	7
+#define L_MUL	8
+#define L_DIV	9
+#define L_MOD	10
+#define L_POW	11
+#define L_MAX	12
+#define L_MIN	13
+#define L_LT	14
+#define L_LE	15
+#define L_GT	16
+#define L_GE	17
+#define L_EQ	18
+#define L_NE	19
+#define L_INC	20
+#define L_DEC	21
+#define L_NOT	22
+#define L_ABS	23
+#define L_SIGN	24
+#define L_IP	25
+#define L_FP	26
+#define L_CEIL	27
+#define L_FLOOR	28
+#define L_SQRT	29
+#define L_LN	30
+#define L_LOG	31
+#define L_EXP	32
+#define L_SIN	33
+#define L_COS	34
+#define L_ATAN	35
+#define L_ASIN	36
+#define L_ACOS	37
+#define L_SINH	38
+#define L_COSH	39
+#define L_TANH	40
+
+/*
+ * The commands a lane program can do, with the values each takes and
+ * leaves.  pick and roll only when a number just before gives k.
+ */
+static struct {
+	char *name;
+	int kind, in, out;
+} lanecmds[] = {
+	{ "pick", L_PICK, 0, 1 }, { "roll", L_ROLL, 0, 0 },
+	{ "dup", L_DUP, 1, 2 }, { "swap", L_SWAP, 2, 2 },
+	{ "drop", L_DROP, 1, 0 }, { "+", L_ADD, 2, 1 },
+	{ "-", L_SUB, 2, 1 }, { "*", L_MUL, 2, 1 }, { "/", L_DIV, 2, 1 },
+	{ "%", L_MOD, 2, 1 }, { "pow", L_POW, 2, 1 },
+	{ "max", L_MAX, 2, 1 }, { "min", L_MIN, 2, 1 },
+	{ "<", L_LT, 2, 1 }, { "<=", L_LE, 2, 1 }, { ">", L_GT, 2, 1 },
+	{ ">=", L_GE, 2, 1 }, { "==", L_EQ, 2, 1 }, { "!=", L_NE, 2, 1 },
+	{ "++", L_INC, 1, 1 }, { "--", L_DEC, 1, 1 }, { "!", L_NOT, 1, 1 },
+	{ "abs", L_ABS, 1, 1 }, { "sign", L_SIGN, 1, 1 },
+	{ "ip", L_IP, 1, 1 }, { "fp", L_FP, 1, 1 },
+	{ "ceil", L_CEIL, 1, 1 }, { "floor", L_FLOOR, 1, 1 },
+	{ "sqrt", L_SQRT, 1, 1 }, { "ln", L_LN, 1, 1 },
+	{ "log", L_LOG, 1, 1 }, { "exp", L_EXP, 1, 1 },
+	{ "sin", L_SIN, 1, 1 }, { "cos", L_COS, 1, 1 },
+	{ "atan", L_ATAN, 1, 1 }, { "asin", L_ASIN, 1, 1 },
+	{ "acos", L_ACOS, 1, 1 }, { "sinh", L_SINH, 1, 1 },
+	{ "cosh", L_COSH, 1, 1 }, { "tanh", L_TANH, 1, 1 },
+	{ "pi", L_NUM, 0, 1 }, { "e", L_NUM, 0, 1 }
+};
+#define NUMLANECMDS (sizeof lanecmds / sizeof *lanecmds)
+
+struct lop {
+	int kind;
+	double k;
+};
+
+/*
+ * A lane program.  depth is how many values its lane stack holds after
+ * the ops so far, starting from the nin values each lane is given.
+ */
+struct prog {
+	struct lop *ops;
+	size_t n, room;
+	int nin, depth;
+};
+
+static void
+lemit(struct prog *p, int kind, double k)
+{
+	if (p->n == p->room) {
+		size_t room = p->room ? p->room * 2 : 32;
+		struct lop *ops;
+
+		if ((ops = realloc(p->ops, room * sizeof *ops)) == NULL) {
+			perror("Error: realloc");
+			exit(1);
+		}
+		p->ops = ops;
+		p->room = room;
+	}
+	p->ops[p->n].kind = kind;
+	p->ops[p->n++].k = k;
+}
+
+static int
+lanecmd(struct prog *p, struct command *cmd)
+{
+	struct lop *last = p->n > 0 ? &p->ops[p->n - 1] : NULL;
+	size_t i;
+	double k;
+
+	for (i = 0; i < NUMLANECMDS; i++)
+		if (strcmp(lanecmds[i].name, cmd->name) == 0)
+			break;
+	if (i == NUMLANECMDS || p->depth < lanecmds[i].in)
+		return 0;
+	switch (lanecmds[i].kind) {
+	case L_PICK:
+	case L_ROLL:
+		if (last == NULL || last->kind != L_NUM)
+			return 0;
+		k = last->k;
+		if (k < 1 || k != floor(k) || p->depth - 1 < k)
+			return 0;
+		last->kind = lanecmds[i].kind;
+		p->depth += lanecmds[i].out - 1;
+		return p->depth <= LANEDEPTH;
+	case L_NUM:
+		lemit(p, L_NUM, cmd->name[0] == 'p' ? 3.14159265358979323846 :
+		    2.7182818284590452354);
+		break;
+	default:
+		lemit(p, lanecmds[i].kind, 0);
+		break;
+	}
+	p->depth += lanecmds[i].out - lanecmds[i].in;
+	return p->depth <= LANEDEPTH;
+}
+
+/*
+ * Flatten c onto the end of p.  Returns 0 if it holds anything a lane
+ * program cannot do.  Inline and fused ops are taken op by op as they
+ * were compiled.
+ */
+static int
+flatten(struct prog *p, struct code *c, int nest)
+{
+	struct op *op;
+	struct macro *macro;
+	size_t i;
+
+	for (i = 0; i < c->n; i++) {
+		op = &c->ops[i];
+		if (op->type == OP_NUM ||
+		    (op->type >= OP_ADDK && op->type <= OP_INV)) {
+			lemit(p, L_NUM, op->u.num);
+			if (++p->depth > LANEDEPTH)
+				return 0;
+		} else if (op->type == OP_INT || op->type == OP_NEGINT) {
+			lemit(p, L_NUM, op->type == OP_NEGINT ?
+			    -(double)op->u.word : (double)op->u.word);
+			if (++p->depth > LANEDEPTH)
+				return 0;
+		} else if (op->type == OP_CMD ||
+		    (op->type >= OP_ADD && op->type <= OP_RDIV)) {
+			if (!lanecmd(p, op->u.cmd))
+				return 0;
+		} else if (op->type == OP_MACRO) {
+			macro = op->u.macro;
+			if (nest == LANENEST)
+				return 0;
+			if (macro->gen != macrogen)
+				compilemacro(macro);
+			if (!flatten(p, &macro->code, nest + 1))
+				return 0;
+		} else
+			return 0;
+	}
+	return 1;
+}
+
+#define EACH	for (i = 0; i < n; i++)
+
+/*
+ * Run p over n lanes, lane i starting with in[0][i] to in[nin - 1][i],
+ * leaving the r-th value it leaves at out[r][i * stride] and flagging
+ * the lanes that fail.  out may be in.
+ */
+static void
+lanes(struct prog *p, const double *const *in, double *const *out,
+    size_t stride, unsigned char *bad, size_t n)
+{
+	double store[LANEDEPTH + 1][BATCH], *col[LANEDEPTH + 1], *t, k;
+	struct lop *lop, *end = p->ops + p->n;
+	size_t i;
+	int d = p->nin, j, r;
+
+	for (j = 0; j <= LANEDEPTH; j++)
+		col[j] = store[j];
+	for (j = 0; j < d; j++)
+		memcpy(col[j], in[j], n * sizeof **in);
+	memset(bad, 0, n);
+
+	for (lop = p->ops; lop < end; lop++) {
+		double *x = col[d - 1], *y = d > 1 ? col[d - 2] : NULL;
+
+		switch (lop->kind) {
+		case L_NUM:
+			k = lop->k;
+			t = col[d++];
+			EACH t[i] = k;
+			break;
+		case L_PICK:
+			memcpy(col[d], col[d - (int)lop->k], n * sizeof *x);
+			d++;
+			break;
+		case L_ROLL:
+			t = col[d - (int)lop->k];
+			for (j = d - (int)lop->k; j < d - 1; j++)
+				col[j] = col[j + 1];
+			col[d - 1] = t;
+			break;
+		case L_DUP:
+			memcpy(col[d++], x, n * sizeof *x);
+			break;
+		case L_SWAP:
+			col[d - 1] = y;
+			col[d - 2] = x;
+			break;
+		case L_DROP:
+			d--;
+			break;
+
+		/* y op x, leaving the result in y */
+		case L_ADD: EACH y[i] += x[i]; d--; break;
+		case L_SUB: EACH y[i] -= x[i]; d--; break;
+		case L_MUL: EACH y[i] *= x[i]; d--; break;
+		case L_DIV:
+			EACH {
+				bad[i] |= x[i] == 0;
+				y[i] /= x[i];
+			}
+			d--;
+			break;
+		case L_MOD:
+			EACH {
+				bad[i] |= x[i] == 0;
+				y[i] = fmod(y[i], x[i]);
+			}
+			d--;
+			break;
+		case L_POW:
+			EACH {
+				bad[i] |= (y[i] == 0 && x[i] <= 0) ||
+				    (y[i] < 0 && x[i] != floor(x[i]));
+				y[i] = pow(y[i], x[i]);
+			}
+			d--;
+			break;
+		case L_MAX: EACH y[i] = x[i] > y[i] ? x[i] : y[i]; d--; break;
+		case L_MIN: EACH y[i] = x[i] < y[i] ? x[i] : y[i]; d--; break;
+		case L_LT: EACH y[i] = y[i] < x[i]; d--; break;
+		case L_LE: EACH y[i] = y[i] <= x[i]; d--; break;
+		case L_GT: EACH y[i] = y[i] > x[i]; d--; break;
+		case L_GE: EACH y[i] = y[i] >= x[i]; d--; break;
+		case L_EQ: EACH y[i] = y[i] == x[i]; d--; break;
+		case L_NE: EACH y[i] = y[i] != x[i]; d--; break;
+
+		/* op x */
+		case L_INC: EACH x[i]++; break;
+		case L_DEC: EACH x[i]--; break;
+		case L_NOT: EACH x[i] = !x[i]; break;
+		case L_ABS: EACH x[i] = x[i] < 0 ? -x[i] : x[i]; break;
+		case L_SIGN:
+			EACH x[i] = x[i] ? (x[i] < 0 ? -1 : 1) : x[i];
+			break;
+		case L_IP: EACH modf(x[i], &x[i]); break;
+		case L_FP: EACH x[i] = modf(x[i], &k); break;
+		case L_CEIL: EACH x[i] = ceil(x[i]); break;
+		case L_FLOOR: EACH x[i] = floor(x[i]); break;
+		case L_SQRT:
+			EACH {
+				bad[i] |= x[i] < 0;
+				x[i] = sqrt(x[i]);
+			}
+			break;
+		case L_LN:
+			EACH {
+				bad[i] |= x[i] < 0;
+				x[i] = log(x[i]);
+			}
+			break;
+		case L_LOG:
+			EACH {
+				bad[i] |= x[i] < 0;
+				x[i] = log10(x[i]);
+			}
+			break;
+		case L_EXP: EACH x[i] = exp(x[i]); break;
+		case L_SIN: EACH x[i] = sin(x[i]); break;
+		case L_COS: EACH x[i] = cos(x[i]); break;
+		case L_ATAN: EACH x[i] = atan(x[i]); break;
+		case L_ASIN:
+			EACH {
+				bad[i] |= x[i] < -1 || x[i] > 1;
+				x[i] = asin(x[i]);
+			}
+			break;
+		case L_ACOS:
+			EACH {
+				bad[i] |= x[i] < -1 || x[i] > 1;
+				x[i] = acos(x[i]);
+			}
+			break;
+		case L_SINH: EACH x[i] = sinh(x[i]); break;
+		case L_COSH: EACH x[i] = cosh(x[i]); break;
+		case L_TANH: EACH x[i] = tanh(x[i]); break;
+		}
+	}
+
+	for (r = 0; r < d; r++) {
+		t = col[r];
+		if (stride == 1)
+			memcpy(out[r], t, n * sizeof *t);
+		else
+			EACH out[r][i * stride] = t[i];
+	}
+}
+
+struct mapjob {
+	struct prog *p;
+	const double *in;
+	double *out;
+	unsigned char *bad;
+	size_t n;
+	int spilled;		/* in is a spilled stack */
+};
+
+static void
+mapchunk(void *arg, size_t c)
+{
+	struct mapjob *j = arg;
+	size_t i, n, end = (c + 1) * CHUNK < j->n ? (c + 1) * CHUNK : j->n;
+	const double *in;
+	double *out[LANEDEPTH];
+	int r, d = j->p->depth;
+
+	for (i = c * CHUNK; i < end; i += n) {
+		n = end - i < BATCH ? end - i : BATCH;
+		in = j->in + i;
+		for (r = 0; r < d; r++)
+			out[r] = j->out + i * d + r;
+		lanes(j->p, &in, out, d, j->bad + i, n);
+	}
+	if (j->spilled)
+		dropvalues(j->in + c * CHUNK, end - c * CHUNK);
+}
+
+/*
+ * Replace the stack with the r values left for each of its values at
+ * out, or a nan for each one flagged in bad.  Returns how many were.
+ * When r is 1, out is the stack itself.
+ */
+static size_t
+gather(double *out, size_t r, unsigned char *bad, size_t n)
+{
+	size_t i, j, nbad = 0;
+
+	for (i = 0; i < n; i++)
+		nbad += bad[i];
+	if (r == 1) {
+		for (i = 0; nbad > 0 && i < n; i++)
+			if (bad[i])
+				M->s[i] = NAN;
+		return nbad;
+	}
+	M->d = 0;
+	while (M->room < (n - nbad) * r + nbad)
+		growstack();
+	for (i = j = 0; i < n; i++)
+		if (bad[i])
+			M->s[j++] = NAN;
+		else {
+			memcpy(&M->s[j], &out[i * r], r * sizeof *out);
+			j += r;
+		}
+	M->d = j;
+	return nbad;
+}
+
+/*
+ * Run body over each value on the stack as a lane program, or return 0
+ * if it cannot be one.
+ */
+static int
+maplanes(struct code *body, size_t *nbad)
+{
+	static __thread struct prog p;
+	struct mapjob j;
+	size_t c, n = M->d, nchunks = (n + CHUNK - 1) / CHUNK;
+
+	p.n = 0;
+	p.nin = p.depth = 1;
+	if (!flatten(&p, body, 0))
+		return 0;
+	if (p.depth == 1)
+		j.out = M->s;
+	else if ((j.out = malloc((n * p.depth + 1) * sizeof *j.out)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	if ((j.bad = malloc(n)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	j.p = &p;
+	j.in = M->s;
+	j.n = n;
+	j.spilled = M->fd >= 0;
+	if (bigjob(n))
+		poolrun(nchunks, mapchunk, &j);
+	else
+		for (c = 0; c < nchunks; c++)
+			mapchunk(&j, c);
+	*nbad = gather(j.out, p.depth, j.bad, n);
+	if (j.out != M->s)
+		free(j.out);
+	free(j.bad);
+	return 1;
+}
+
+/*
+ * Run body over each value on the stack with run(), on a stack of its
+ * own.  Its errors are counted but not reported.
+ */
+static size_t
+mapscalar(struct code *body)
+{
+	struct metastack *orig = M, *one = newstack(NULL);
+	double *out = NULL;
+	size_t i, n = orig->d, nout = 0, room = 0, nbad = 0;
+	unsigned long errs;
+
+	quiet++;
+	for (i = 0; i < n; i++) {
+		M = one;
+		one->d = 0;
+		pushnum(orig->s[i]);
+		errs = nerrors;
+		run(body);
+		while (M != one)
+			popstack();
+		if (nerrors != errs) {
+			one->s[0] = wordsize != 0 ? 0 : NAN;
+			one->d = 1;
+			nbad++;
+		}
+		if (nout + one->d > room) {
+			room = room ? room * 2 : 64;
+			if (room < nout + one->d)
+				room = nout + one->d;
+			if ((out = realloc(out, room * sizeof *out)) == NULL) {
+				perror("Error: realloc");
+				exit(1);
+			}
+		}
+		memcpy(&out[nout], one->s, one->d * sizeof *out);
+		nout += one->d;
+	}
+	quiet--;
+	M = orig;
+	while (M->room < nout)
+		growstack();
+	memcpy(M->s, out, nout * sizeof *out);
+	M->d = nout;
+	free(out);
+	freestack(one);
+	return nbad;
+}
+
+/*
+ * Batches, for the library's rpn_batch() and rpn -e -b.  Each row
+ * starts on an empty stack with its values pushed in column order.
+ */
+struct batchjob {
+	struct prog *p;
+	const double *const *in;
+	double *const *out;
+	unsigned char *bad;
+	size_t n;
+};
+
+static void
+batchchunk(void *arg, size_t c)
+{
+	struct batchjob *j = arg;
+	size_t i, n, end = (c + 1) * CHUNK < j->n ? (c + 1) * CHUNK : j->n;
+	const double *in[LANEDEPTH];
+	double *out[LANEDEPTH];
+	int r;
+
+	for (i = c * CHUNK; i < end; i += n) {
+		n = end - i < BATCH ? end - i : BATCH;
+		for (r = 0; r < j->p->nin; r++)
+			in[r] = j->in[r] + i;
+		for (r = 0; r < j->p->depth; r++)
+			out[r] = j->out[r] + i;
+		lanes(j->p, in, out, 1, j->bad + i, n);
+	}
+}
+
+static size_t
+batchscalar(struct code *c, int nin, const double *const *in, int nout,
+    double *const *out, size_t n)
+{
+	struct metastack *orig = M, *one = newstack(NULL);
+	size_t i, nbad = 0;
+	unsigned long errs;
+	int r, size = wordsize, sign = wordsigned;
+
+	quiet++;
+	for (i = 0; i < n; i++) {
+		M = one;
+		one->d = 0;
+		wordsize = 0;
+		for (r = 0; r < nin; r++)
+			pushnum(in[r][i]);
+		errs = nerrors;
+		run(c);
+		while (M != one)
+			popstack();
+		if (nerrors != errs || one->d != (size_t)nout) {
+			for (r = 0; r < nout; r++)
+				out[r][i] = NAN;
+			nbad++;
+		} else
+			for (r = 0; r < nout; r++)
+				out[r][i] = wordsize != 0 ? wordtonum(one->s[r]) :
+				    one->s[r];
+	}
+	quiet--;
+	M = orig;
+	wordsize = size;
+	wordsigned = sign;
+	freestack(one);
+	return nbad;
+}
+
+/*
+ * Run c over n rows of nin input columns, leaving the nout values each
+ * row leaves in nout output columns.  A row that fails, or leaves some
+ * other number of values, is nan in all of them.  Returns how many
+ * rows were.
+ */
+size_t
+batch(struct code *c, int nin, const double *const *in, int nout,
+    double *const *out, size_t n)
+{
+	static __thread struct prog p;
+	struct batchjob j;
+	size_t i, nbad = 0, nchunks = (n + CHUNK - 1) / CHUNK;
+	int r;
+
+	p.n = 0;
+	p.nin = p.depth = nin;
+	if (nin > LANEDEPTH || !flatten(&p, c, 0) || p.depth != nout)
+		return batchscalar(c, nin, in, nout, out, n);
+	if ((j.bad = malloc(n)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	j.p = &p;
+	j.in = in;
+	j.out = out;
+	j.n = n;
+	if (bigjob(n))
+		poolrun(nchunks, batchchunk, &j);
+	else
+		for (i = 0; i < nchunks; i++)
+			batchchunk(&j, i);
+	for (i = 0; i < n; i++)
+		if (j.bad[i]) {
+			for (r = 0; r < nout; r++)
+				out[r][i] = NAN;
+			nbad++;
+		}
+	free(j.bad);
+	return nbad;
+}
+
+/*
+ * How many values c leaves for a row of nin values if it runs as a lane
+ * program, which leaves the same number for every row, or -1 if it does
+ * not.
+ */
+int
+batchlanes(struct code *c, int nin)
+{
+	static __thread struct prog p;
+
+	p.n = 0;
+	p.nin = p.depth = nin;
+	return nin <= LANEDEPTH && flatten(&p, c, 0) ? p.depth : -1;
+}
+
+/*
+ * How many values c leaves for a row of nin values, found from its
+ * lane program or else by running it over row.  Returns -1 if it
+ * fails there.
+ */
+int
+batchwidth(struct code *c, int nin, const double *row)
+{
+	struct metastack *orig = M;
+	unsigned long errs = nerrors;
+	int r, size = wordsize, sign = wordsigned;
+
+	if ((r = batchlanes(c, nin)) >= 0)
+		return r;
+	M = newstack(NULL);
+	wordsize = 0;
+	quiet++;
+	for (r = 0; r < nin; r++)
+		pushnum(row[r]);
+	run(c);
+	while (M->n != NULL)
+		popstack();
+	quiet--;
+	r = nerrors == errs ? (int)M->d : -1;
+	freestack(M);
+	M = orig;
+	wordsize = size;
+	wordsigned = sign;
+	return r;
+}
+
+/*
+ * Run an OP_MAP or OP_MAPCMD op.
+ */
+void
+map(struct op *op)
+{
+	static __thread char msg[64];
+	struct op one;
+	struct code cmdcode = { &one, 1, 1 }, *body;
+	char *name;
+	size_t nbad;
+
+	if (op->type == OP_MAP) {
+		if (op->u.macro->gen != macrogen)
+			compilemacro(op->u.macro);
+		body = &op->u.macro->code;
+		name = op->u.macro->name;
+	} else {
+		one.type = OP_CMD;
+		one.u.cmd = op->u.cmd;
+		body = &cmdcode;
+		name = op->u.cmd->name;
+	}
+	if (M->d == 0)
+		return;
+	if (wordsize != 0 || !maplanes(body, &nbad))
+		nbad = mapscalar(body);
+	trimstack();
+	if (nbad > 0) {
+		snprintf(msg, sizeof msg, "Failed for %lu value%s, now %s.",
+		    (unsigned long)nbad, nbad == 1 ? "" : "s",
+		    wordsize != 0 ? "0" : "nan");
+		thiscmd = name;
+		error(msg);
+	}
+}
@@ -0,0 +1,81 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+/*
+ * mkhash - write cmdhash.h, a collision-free hash of the built-in command
+ * names in commands.h.  findcmd() hashes a word with CMDHASH_SEED and
+ * gets the only _commands[] entry it can possibly be, so a lookup costs
+ * one hash and one strcmp.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+
+#define CMD(name, numargs, function)	name,
+static const char *names[] = {
+#include "commands.h"
+};
+#undef CMD
+#define NUMNAMES (sizeof names / sizeof *names)
+
+#define MAXSEEDS	(1UL << 20)
+#define MAXTABLE	65536
+
+static void
+output(unsigned short *tab, size_t size, uint32_t seed)
+{
+	size_t i;
+
+	printf("/* Generated by mkhash from commands.h; do not edit. */\n\n");
+	printf("#define CMDHASH_SEED\t%luU\n", (unsigned long)seed);
+	printf("#define CMDHASH_SIZE\t%lu\n\n", (unsigned long)size);
+	printf("/* index + 1 into _commands[], or 0 */\n");
+	printf("static const unsigned short cmdhash[CMDHASH_SIZE] = {");
+	for (i = 0; i < size; i++)
+		printf("%s%3u,", i % 12 ? " " : "\n\t", tab[i]);
+	printf("\n};\n");
+}
+
+int
+main(void)
+{
+	size_t size, i, j;
+	uint32_t seed, h;
+	unsigned short *tab;
+
+	for (i = 0; i < NUMNAMES; i++)
+		for (j = i + 1; j < NUMNAMES; j++)
+			if (strcmp(names[i], names[j]) == 0) {
+				fprintf(stderr, "mkhash: duplicate command %s\n", names[i]);
+				return 1;
+			}
+
+	for (size = 1; size < NUMNAMES * 4; size <<= 1)
+		;
+	for (; size <= MAXTABLE; size <<= 1) {
+		if ((tab = malloc(size * sizeof *tab)) == NULL) {
+			perror("mkhash: malloc");
+			return 1;
+		}
+		for (seed = 0; seed < MAXSEEDS; seed++) {
+			memset(tab, 0, size * sizeof *tab);
+			for (i = 0; i < NUMNAMES; i++) {
+				h = hashstr(names[i], seed) & (size - 1);
+				if (tab[h] != 0)
+					break;
+				tab[h] = i + 1;
+			}
+			if (i == NUMNAMES) {
+				output(tab, size, seed);
+				return 0;
+			}
+		}
+		free(tab);
+	}
+
+	fprintf(stderr, "mkhash: no perfect hash found\n");
+	return 1;
+}
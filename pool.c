@@ -0,0 +1,215 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+/*
+ * A pool of threads for operations over the whole stack.
+ *
+ * poolrun() cuts a job into chunks whose size does not depend on the
+ * number of threads, and each chunk writes its result to its own place,
+ * so results come out the same however the chunks are scheduled.  Each
+ * thread starts on its own share of the chunks, taking them from the
+ * front, and when that runs out steals from the back of another's.
+ * Only jobs of at least parmin values are worth sending to the pool;
+ * callers check bigjob() first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "rpn.h"
+
+#define DEFPARMIN	(1 << 18)
+
+int threads = 0;		/* 0 until set from $RPN_THREADS or the CPUs */
+size_t parmin = 0;
+
+static struct {
+	pthread_mutex_t job;	/* held while a job runs */
+	pthread_mutex_t lock;
+	pthread_cond_t go, idle;
+	unsigned long gen;	/* bumped to start a job */
+	int nworkers, nshares, busy;
+	void (*fn)(void *, size_t);
+	void *arg;
+	uint64_t *shares;	/* next chunk | end << 32, one per thread */
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	   PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void
+readenv(void)
+{
+	char *env;
+	long n;
+
+	if (threads == 0) {
+		if ((env = getenv("RPN_THREADS")) != NULL && (n = atol(env)) > 0)
+			threads = n < MAXTHREADS ? n : MAXTHREADS;
+		else if ((n = sysconf(_SC_NPROCESSORS_ONLN)) > 0)
+			threads = n < MAXTHREADS ? n : MAXTHREADS;
+		else
+			threads = 1;
+	}
+	if (parmin == 0) {
+		if ((env = getenv("RPN_PARMIN")) != NULL && (n = atol(env)) > 0)
+			parmin = n;
+		else
+			parmin = DEFPARMIN;
+	}
+}
+
+/*
+ * Settle threads and parmin the first time either is needed, once for
+ * all the threads that might need them.
+ */
+static void
+setup(void)
+{
+	pthread_once(&once, readenv);
+}
+
+/*
+ * Is a job over n values big enough for the pool?
+ */
+int
+bigjob(size_t n)
+{
+	setup();
+	return threads > 1 && n >= parmin;
+}
+
+/*
+ * Take a chunk from the front of share self, or else from the back of
+ * any other share.
+ */
+static int
+take(int self, size_t *chunk)
+{
+	uint64_t s, lo, hi;
+	int i, v;
+
+	for (i = 0; i < pool.nshares; i++) {
+		v = (self + i) % pool.nshares;
+		s = __atomic_load_n(&pool.shares[v], __ATOMIC_ACQUIRE);
+		for (;;) {
+			lo = s & 0xffffffff;
+			hi = s >> 32;
+			if (lo >= hi)
+				break;
+			if (i == 0) {
+				if (__atomic_compare_exchange_n(&pool.shares[v], &s,
+				    (lo + 1) | hi << 32, 0, __ATOMIC_ACQ_REL,
+				    __ATOMIC_ACQUIRE)) {
+					*chunk = lo;
+					return 1;
+				}
+			} else if (__atomic_compare_exchange_n(&pool.shares[v], &s,
+			    lo | (hi - 1) << 32, 0, __ATOMIC_ACQ_REL,
+			    __ATOMIC_ACQUIRE)) {
+				*chunk = hi - 1;
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+struct start {
+	int self;
+	unsigned long gen;
+};
+
+static void *
+worker(void *arg)
+{
+	struct start *st = arg;
+	int self = st->self;
+	unsigned long gen = st->gen;
+	size_t chunk;
+
+	free(st);
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.gen == gen)
+			pthread_cond_wait(&pool.go, &pool.lock);
+		gen = pool.gen;
+		if (self >= pool.nshares)
+			continue;
+		pthread_mutex_unlock(&pool.lock);
+
+		while (take(self, &chunk))
+			pool.fn(pool.arg, chunk);
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.busy == 0)
+			pthread_cond_signal(&pool.idle);
+	}
+	return NULL;
+}
+
+/*
+ * Run fn(arg, i) for every chunk i below n on the calling thread and
+ * the pool.  If the pool is already busy, as it can be with -j, the
+ * chunks run on the calling thread alone.
+ */
+void
+poolrun(size_t n, void (*fn)(void *, size_t), void *arg)
+{
+	struct start *st;
+	pthread_t tid;
+	size_t i;
+	int k;
+
+	setup();
+	if (threads <= 1 || n < 2 || n > UINT32_MAX ||
+	    pthread_mutex_trylock(&pool.job) != 0) {
+		for (i = 0; i < n; i++)
+			fn(arg, i);
+		return;
+	}
+
+	k = (size_t)threads < n ? threads : (int)n;
+	while (pool.nworkers < k - 1) {
+		if ((st = malloc(sizeof *st)) == NULL) {
+			perror("Error: malloc");
+			exit(1);
+		}
+		st->self = pool.nworkers + 1;
+		st->gen = pool.gen;
+		if (pthread_create(&tid, NULL, worker, st) != 0) {
+			free(st);
+			k = pool.nworkers + 1;
+			break;
+		}
+		pthread_detach(tid);
+		pool.nworkers++;
+	}
+	if ((pool.shares = realloc(pool.shares, k * sizeof *pool.shares)) == NULL) {
+		perror("Error: realloc");
+		exit(1);
+	}
+	for (i = 0; i < (size_t)k; i++)
+		pool.shares[i] = (n * i / k) | (uint64_t)(n * (i + 1) / k) << 32;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.nshares = k;
+	pool.busy = k - 1;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.go);
+	pthread_mutex_unlock(&pool.lock);
+
+	while (take(0, &i))
+		fn(arg, i);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.busy > 0)
+		pthread_cond_wait(&pool.idle, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+	pthread_mutex_unlock(&pool.job);
+}
@@ -0,0 +1,652 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+/*
+ * rpn -e: run one compiled expression over every line of input.  Also
+ * rpn -c, which streams one column of input through the statistics, and
+ * rpn -e -b, which runs the expression over rows of columns in batches.
+ *
+ * With more than one job the input is cut into blocks of whole lines.
+ * Worker threads, each with its own stack, take blocks in turn and
+ * format their output into memory, and the main thread writes the
+ * finished blocks out in input order.
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "rpn.h"
+
+#define BLOCKSIZE	(1 << 20)
+
+extern __thread struct metastack *M;
+extern __thread int repeat, stop, wordsize, abandon;
+extern __thread char *thiscmd;
+extern __thread unsigned long nerrors;
+extern __thread FILE *outfp;
+extern __thread int quiet;
+extern __thread size_t memlimit;
+extern size_t defmemlimit;
+
+/*
+ * Run prog over one record: push the fields of line onto an empty stack,
+ * in floating point, run prog and print what is left.  The first error
+ * in a record ends it, and it prints only that error, so there is always
+ * one line of output per line of input.
+ */
+static void
+record(struct code *prog, char *line)
+{
+	char *field;
+	double num;
+	unsigned long errs = nerrors;
+
+	clearstack();
+	repeat = 1;
+	wordsize = 0;
+	abandon = 1;
+	for (;;) {
+		while (isspace(*line))
+			line++;
+		if (*line == '\0')
+			break;
+		for (field = line; *line != '\0' && !isspace(*line); line++)
+			;
+		if (*line != '\0')
+			*line++ = '\0';
+		if (!parsenum(field, &num)) {
+			thiscmd = field;
+			error(ERR_NOTNUM);
+			stop = 0;
+			return;
+		}
+		pushnum(num);
+	}
+
+	run(prog);
+	if (nerrors == errs)
+		printstk("\n");
+}
+
+/*
+ * Run prog over each line in buf[0..len), which must have room for a
+ * terminating '\0' after it.
+ */
+static unsigned long
+block(struct code *prog, char *buf, size_t len)
+{
+	char *line, *nl, *end = buf + len;
+	unsigned long count = 0;
+
+	for (line = buf; (nl = memchr(line, '\n', end - line)) != NULL; line = nl + 1) {
+		*nl = '\0';
+		record(prog, line);
+		count++;
+	}
+	if (line < end) {
+		*end = '\0';
+		record(prog, line);
+		count++;
+	}
+	return count;
+}
+
+/*
+ * Read the next block of whole lines from fp into *buf, which has *room
+ * bytes.  *have bytes are already there from the last call; on return
+ * *have is how many bytes past the returned length belong to the next
+ * block.  Returns 0 at the end of input.
+ */
+static size_t
+readblock(FILE *fp, char **buf, size_t *room, size_t *have)
+{
+	size_t n, len;
+	char *nl;
+
+	for (;;) {
+		if (*have + 1 >= *room) {
+			*room *= 2;
+			if ((*buf = realloc(*buf, *room)) == NULL) {
+				perror("Error: realloc");
+				exit(1);
+			}
+		}
+		n = fread(*buf + *have, 1, *room - *have - 1, fp);
+		*have += n;
+		if (n == 0) {
+			if (ferror(fp))
+				perror("Error: read");
+			len = *have;
+			*have = 0;
+			return len;
+		}
+		for (nl = *buf + *have; nl > *buf && nl[-1] != '\n'; nl--)
+			;
+		if (nl > *buf) {
+			len = nl - *buf;
+			*have -= len;
+			return len;
+		}
+	}
+}
+
+static char *
+xmalloc(size_t n)
+{
+	char *p;
+
+	if ((p = malloc(n)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	return p;
+}
+
+static unsigned long
+serial(struct code *prog, FILE *fp)
+{
+	static char *buf = NULL;
+	static size_t room = BLOCKSIZE;
+	size_t have = 0, len;
+	unsigned long count = 0;
+
+	if (buf == NULL)
+		buf = xmalloc(room);
+	while ((len = readblock(fp, &buf, &room, &have)) != 0) {
+		count += block(prog, buf, len);
+		memmove(buf, buf + len, have);
+	}
+	return count;
+}
+
+/*
+ * Blocks cycle through the slots of a ring: the main thread fills slot
+ * nread % NSLOTS, workers run them in order of nrun, and the main
+ * thread writes them out in order of nwritten.
+ */
+#define EMPTY	0
+#define FILLED	1
+#define RUNNING	2
+#define DONE	3
+
+struct slot {
+	int state;
+	char *in, *out;
+	size_t room, len, outlen;
+	unsigned long count;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	struct code *prog;
+	struct slot *slots;
+	size_t nslots;
+	unsigned long nread, nrun, nwritten;
+	int eof;
+} ring = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	   PTHREAD_COND_INITIALIZER };
+
+static void *
+worker(void *arg)
+{
+	struct slot *sl;
+
+	(void)arg;
+	M = newstack(NULL);
+	memlimit = defmemlimit;
+	pthread_mutex_lock(&ring.lock);
+	for (;;) {
+		while (ring.nrun == ring.nread && !ring.eof)
+			pthread_cond_wait(&ring.work, &ring.lock);
+		if (ring.nrun == ring.nread)
+			break;
+		sl = &ring.slots[ring.nrun++ % ring.nslots];
+		sl->state = RUNNING;
+		pthread_mutex_unlock(&ring.lock);
+
+		if ((outfp = open_memstream(&sl->out, &sl->outlen)) == NULL) {
+			perror("Error: open_memstream");
+			exit(1);
+		}
+		sl->count = block(ring.prog, sl->in, sl->len);
+		fclose(outfp);
+
+		pthread_mutex_lock(&ring.lock);
+		sl->state = DONE;
+		pthread_cond_broadcast(&ring.done);
+	}
+	pthread_mutex_unlock(&ring.lock);
+	return NULL;
+}
+
+static unsigned long
+parallel(struct code *prog, FILE *fp, int jobs)
+{
+	pthread_t *tids;
+	struct slot *sl;
+	char *carry;
+	size_t carryroom = BLOCKSIZE, have = 0, i;
+	unsigned long count = 0;
+	int j;
+
+	ring.prog = prog;
+	ring.nslots = jobs * 2;
+	ring.nread = ring.nrun = ring.nwritten = 0;
+	ring.eof = 0;
+	if ((ring.slots = calloc(ring.nslots, sizeof *ring.slots)) == NULL ||
+	    (tids = calloc(jobs, sizeof *tids)) == NULL) {
+		perror("Error: calloc");
+		exit(1);
+	}
+	for (i = 0; i < ring.nslots; i++) {
+		ring.slots[i].room = BLOCKSIZE;
+		ring.slots[i].in = xmalloc(BLOCKSIZE);
+	}
+	carry = xmalloc(carryroom);
+
+	for (j = 0; j < jobs; j++)
+		if (pthread_create(&tids[j], NULL, worker, NULL) != 0) {
+			perror("Error: pthread_create");
+			exit(1);
+		}
+
+	pthread_mutex_lock(&ring.lock);
+	for (;;) {
+		sl = &ring.slots[ring.nwritten % ring.nslots];
+		if (ring.nwritten < ring.nread && sl->state == DONE) {
+			pthread_mutex_unlock(&ring.lock);
+			fwrite(sl->out, 1, sl->outlen, stdout);
+			free(sl->out);
+			count += sl->count;
+			pthread_mutex_lock(&ring.lock);
+			sl->state = EMPTY;
+			ring.nwritten++;
+		} else if (!ring.eof && ring.nread - ring.nwritten < ring.nslots) {
+			sl = &ring.slots[ring.nread % ring.nslots];
+			pthread_mutex_unlock(&ring.lock);
+
+			/*
+			 * readblock() works in one buffer, so the slot's
+			 * buffer and the carried-over tail swap places.
+			 */
+			if (carryroom > sl->room) {
+				free(sl->in);
+				sl->in = xmalloc(carryroom);
+				sl->room = carryroom;
+			}
+			memcpy(sl->in, carry, have);
+			sl->len = readblock(fp, &sl->in, &sl->room, &have);
+			if (have > carryroom) {
+				free(carry);
+				carry = xmalloc(carryroom = sl->room);
+			}
+			memcpy(carry, sl->in + sl->len, have);
+
+			pthread_mutex_lock(&ring.lock);
+			if (sl->len == 0)
+				ring.eof = 1;
+			else {
+				sl->state = FILLED;
+				ring.nread++;
+			}
+			pthread_cond_broadcast(&ring.work);
+		} else if (ring.eof && ring.nwritten == ring.nread)
+			break;
+		else
+			pthread_cond_wait(&ring.done, &ring.lock);
+	}
+	pthread_mutex_unlock(&ring.lock);
+
+	for (j = 0; j < jobs; j++)
+		pthread_join(tids[j], NULL);
+	for (i = 0; i < ring.nslots; i++)
+		free(ring.slots[i].in);
+	free(ring.slots);
+	free(tids);
+	free(carry);
+	return count;
+}
+
+/*
+ * Run prog over every line of fp with jobs threads.
+ */
+unsigned long
+records(struct code *prog, FILE *fp, int jobs)
+{
+	if (jobs <= 1)
+		return serial(prog, fp);
+	compilemacros();
+	return parallel(prog, fp, jobs);
+}
+
+/*
+ * rpn -c: add field col of every line of fp to *m, a CHUNK of values at
+ * a time, without keeping the column, and add the last values when fp
+ * is NULL.  Lines without the field are skipped.  Returns the number of
+ * lines.
+ */
+unsigned long
+column(int col, FILE *fp, struct moments *m)
+{
+	static char *buf = NULL;
+	static size_t room = BLOCKSIZE;
+	static double *vals;
+	static size_t nvals;
+	struct moments part;
+	size_t have = 0, len;
+	unsigned long count = 0;
+	char *line, *nl, *end, *field;
+	double num;
+	int i;
+
+	if (buf == NULL) {
+		buf = xmalloc(room);
+		vals = (double *)xmalloc(CHUNK * sizeof *vals);
+	}
+	if (fp == NULL) {
+		moments(&part, vals, nvals);
+		addmoments(m, &part);
+		nvals = 0;
+		return 0;
+	}
+	while ((len = readblock(fp, &buf, &room, &have)) != 0) {
+		end = buf + len;
+		for (line = buf; line < end; line = nl + 1) {
+			if ((nl = memchr(line, '\n', end - line)) == NULL)
+				nl = end;
+			*nl = '\0';
+			count++;
+			for (i = 0, field = NULL; i < col; i++) {
+				while (isspace(*line))
+					line++;
+				if (*line == '\0')
+					break;
+				for (field = line; *line != '\0' && !isspace(*line); line++)
+					;
+				if (*line != '\0')
+					*line++ = '\0';
+			}
+			if (i < col)
+				continue;
+			if (!parsenum(field, &num)) {
+				thiscmd = field;
+				error(ERR_NOTNUM);
+				stop = 0;
+				continue;
+			}
+			vals[nvals++] = num;
+			if (nvals == CHUNK) {
+				moments(&part, vals, nvals);
+				addmoments(m, &part);
+				nvals = 0;
+			}
+		}
+		memmove(buf, buf + len, have);
+	}
+	return count;
+}
+
+/*
+ * rpn -e expression -b ncols: run prog over rows of ncols values with
+ * batch(), a CHUNK of rows at a time.  Text rows are the first ncols
+ * fields of a line, separated by spaces, tabs or commas, and print as
+ * -e prints them, except that a row that fails prints nans.  A program
+ * that is not a lane program runs over text rows one at a time, so each
+ * prints its own stack.  Binary rows are ncols native doubles, and come
+ * out as the values prog leaves, as many for every row as it leaves for
+ * the first row that does not fail, or one if none of them succeeds.
+ */
+static struct {
+	struct code *prog;
+	int ncols, width, binary, byrow;
+	double **in, **out, *row;
+	double *rows;		/* a CHUNK of binary rows */
+	size_t n;
+	unsigned long nbad;
+	unsigned long pending;	/* failed binary rows before the width */
+} tab;
+
+static double **
+newcols(int n)
+{
+	double **cols;
+	int c;
+
+	if ((cols = calloc(n > 0 ? n : 1, sizeof *cols)) == NULL) {
+		perror("Error: calloc");
+		exit(1);
+	}
+	for (c = 0; c < n; c++)
+		cols[c] = (double *)xmalloc(CHUNK * sizeof **cols);
+	return cols;
+}
+
+/*
+ * Run the text rows gathered so far one at a time, printing each one's
+ * stack, or nan if it fails.
+ */
+static void
+tablerows(void)
+{
+	struct metastack *orig = M;
+	unsigned long errs;
+	size_t i;
+	int c;
+
+	for (i = 0; i < tab.n; i++) {
+		clearstack();
+		repeat = 1;
+		wordsize = 0;
+		for (c = 0; c < tab.ncols; c++)
+			pushnum(tab.in[c][i]);
+		errs = nerrors;
+		quiet++;
+		run(tab.prog);
+		quiet--;
+		while (M != orig)
+			popstack();
+		if (nerrors != errs) {
+			clearstack();
+			pushnum(NAN);
+			tab.nbad++;
+		}
+		printstk("\n");
+	}
+	tab.n = 0;
+}
+
+/*
+ * Find the width of binary output from the first row gathered so far
+ * that succeeds, or settle on one at the end of the input, and write
+ * the rows that failed before it.  Returns 0 if it is still not known.
+ */
+static int
+tablewidth(int last)
+{
+	size_t i, k;
+	int c;
+
+	for (i = 0; i < tab.n && tab.width < 0; i++) {
+		for (c = 0; c < tab.ncols; c++)
+			tab.row[c] = tab.in[c][i];
+		tab.width = batchwidth(tab.prog, tab.ncols, tab.row);
+	}
+	if (tab.width < 0 && !last) {
+		tab.pending += tab.n;
+		tab.nbad += tab.n;
+		tab.n = 0;
+		return 0;
+	}
+	if (tab.width < 0)
+		tab.width = 1;
+	tab.out = newcols(tab.width);
+	if (tab.width > tab.ncols && (tab.rows = realloc(tab.rows,
+	    (size_t)tab.width * CHUNK * sizeof *tab.rows)) == NULL) {
+		perror("Error: realloc");
+		exit(1);
+	}
+	for (i = 0; i < (size_t)tab.width * CHUNK; i++)
+		tab.rows[i] = NAN;
+	for (; tab.pending > 0; tab.pending -= k) {
+		k = tab.pending < CHUNK ? tab.pending : CHUNK;
+		fwrite(tab.rows, sizeof *tab.rows * tab.width, k, stdout);
+	}
+	return 1;
+}
+
+/*
+ * Run and write out the rows gathered so far, and at the end of the
+ * input, anything still held back.
+ */
+static void
+tableflush(int last)
+{
+	size_t i;
+	int c;
+
+	if (tab.width < 0 && !tab.binary && !tab.byrow) {
+		if ((tab.width = batchlanes(tab.prog, tab.ncols)) < 0)
+			tab.byrow = 1;
+		else
+			tab.out = newcols(tab.width);
+	}
+	if (tab.byrow) {
+		tablerows();
+		return;
+	}
+	if (tab.width < 0 && (tab.n > 0 || tab.pending > 0) &&
+	    !tablewidth(last))
+		return;
+	if (tab.n == 0)
+		return;
+	tab.nbad += batch(tab.prog, tab.ncols, (const double *const *)tab.in,
+	    tab.width, tab.out, tab.n);
+	if (tab.binary) {
+		for (c = 0; c < tab.width; c++)
+			for (i = 0; i < tab.n; i++)
+				tab.rows[i * tab.width + c] = tab.out[c][i];
+		fwrite(tab.rows, sizeof *tab.rows * tab.width, tab.n, stdout);
+	} else
+		for (i = 0; i < tab.n; i++) {
+			clearstack();
+			for (c = 0; c < tab.width; c++)
+				pushnum(tab.out[c][i]);
+			printstk("\n");
+		}
+	tab.n = 0;
+}
+
+/*
+ * Report a row that cannot be read, after the rows before it.
+ */
+static void
+tableerror(char *what, char *msg)
+{
+	tableflush(0);
+	thiscmd = what;
+	error(msg);
+	stop = 0;
+}
+
+/*
+ * Gather the fields of a text line as the next row.
+ */
+static void
+tableline(char *line)
+{
+	char *field;
+	double num;
+	int c;
+
+	for (c = 0; c < tab.ncols; c++) {
+		while (isspace(*line) || *line == ',')
+			line++;
+		if (*line == '\0') {
+			tableerror("-b", ERR_ARGC);
+			return;
+		}
+		for (field = line; *line != '\0' && !isspace(*line) &&
+		    *line != ','; line++)
+			;
+		if (*line != '\0')
+			*line++ = '\0';
+		if (!parsenum(field, &num)) {
+			tableerror(field, ERR_NOTNUM);
+			return;
+		}
+		tab.in[c][tab.n] = num;
+	}
+	if (++tab.n == CHUNK)
+		tableflush(0);
+}
+
+/*
+ * Run prog over the rows of fp, or finish with fp NULL.  Returns the
+ * number of rows, and adds the number that failed to *nbad.
+ */
+unsigned long
+table(struct code *prog, int ncols, int binary, FILE *fp, unsigned long *nbad)
+{
+	static char *buf = NULL;
+	static size_t room = BLOCKSIZE;
+	size_t have = 0, len, got, i;
+	unsigned long count = 0;
+	char *line, *nl, *end;
+	int c;
+
+	if (tab.in == NULL) {
+		tab.prog = prog;
+		tab.ncols = ncols;
+		tab.binary = binary;
+		tab.width = -1;
+		tab.in = newcols(ncols);
+		tab.row = (double *)xmalloc(ncols * sizeof *tab.row);
+		if (binary)
+			tab.rows = (double *)xmalloc((size_t)ncols * CHUNK *
+			    sizeof *tab.rows);
+	}
+	if (fp == NULL) {
+		tableflush(1);
+		*nbad += tab.nbad;
+		tab.nbad = 0;
+		return 0;
+	}
+	if (binary) {
+		len = sizeof *tab.rows * ncols;
+		while ((got = fread(tab.rows, 1, len * (CHUNK - tab.n), fp)) > 0) {
+			if (got % len != 0)
+				fprintf(stderr, "rpn: ignoring %zu bytes of a "
+				    "partial row at end of input\n", got % len);
+			got /= len;
+			for (c = 0; c < ncols; c++)
+				for (i = 0; i < got; i++)
+					tab.in[c][tab.n + i] = tab.rows[i * ncols + c];
+			count += got;
+			if ((tab.n += got) == CHUNK)
+				tableflush(0);
+		}
+		if (ferror(fp))
+			perror("Error: read");
+		return count;
+	}
+	if (buf == NULL)
+		buf = xmalloc(room);
+	while ((len = readblock(fp, &buf, &room, &have)) != 0) {
+		end = buf + len;
+		for (line = buf; line < end; line = nl + 1) {
+			if ((nl = memchr(line, '\n', end - line)) == NULL)
+				nl = end;
+			*nl = '\0';
+			tableline(line);
+			count++;
+		}
+		memmove(buf, buf + len, have);
+	}
+	return count;
+}
@@ -9,200 +9,1189 @@
 #include <string.h>
 #include <time.h>
 #include <limits.h>
+#include <stdint.h>
 #include <math.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <assert.h>
 #include "rpn.h"
 
-int base = DEFBASE, stop = 0;
-struct metastack *M = NULL;
-int stackmode = 0;
-int padcount = 0;
+/*
+ * Interpreter state is per thread, so that -j workers can each run
+ * their own stack.
+ */
+__thread int base = DEFBASE, stop = 0;
+__thread struct metastack *M = NULL;
+__thread int stackmode = 0;
+__thread int padcount = 0;
+__thread int digits = DEFDIGITS;
+__thread FILE *outfp = NULL;
+__thread int abandon = 0;	/* an error ends the whole run, not its macro */
+
+extern __thread int repeat;
+extern __thread int wordsize;
+extern __thread char *thiscmd;
+extern unsigned long macrogen;
+
+/*
+ * With a memory limit, a stack that would take more than memlimit / 2
+ * bytes moves into a shared mapping of an unlinked temporary file and
+ * from then on grows memlimit / 2 bytes at a time.  It stays one array,
+ * so nothing else changes, but whenever it grows, and after the commands
+ * that walk the whole stack, trimstack() lets go of all but the top
+ * memlimit / 2 bytes of it and of the room above the top.  The commands
+ * that walk it a chunk at a time let go of each chunk as they finish it
+ * with dropvalues().  The kernel writes those pages out to the file and
+ * reads them back in, with readahead, when they are touched again, so
+ * what stays resident is bounded by the limit.
+ */
+__thread size_t memlimit = 0;	/* bytes, 0 for none */
+size_t defmemlimit = 0;		/* what threads start with, from $RPN_MEMLIMIT */
+
+void
+trimstack(void)
+{
+	size_t page = sysconf(_SC_PAGESIZE), used, cold;
 
-static void process(char *);
+	if (M->fd < 0)
+		return;
+	used = M->d * sizeof *M->s;
+	cold = used > memlimit / 2 ? (used - memlimit / 2) / page * page : 0;
+	if (cold > 0)
+		madvise(M->s, cold, MADV_DONTNEED);
+	used = (used + page - 1) / page * page;
+	if (used < M->maplen)
+		madvise((char *)M->s + used, M->maplen - used, MADV_DONTNEED);
+}
 
-extern int repeat;
+/*
+ * Let go of the pages wholly inside the n values at p, which must be
+ * part of a spilled stack.  Safe from any thread.
+ */
+void
+dropvalues(const double *p, size_t n)
+{
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t lo = ((uintptr_t)p + page - 1) / page * page;
+	uintptr_t hi = (uintptr_t)(p + n) / page * page;
 
-struct object *
-top(void) {
-	return(M->t);
+	if (hi > lo)
+		madvise((void *)lo, hi - lo, MADV_DONTNEED);
 }
 
 static void
-push(struct object *obj)
+spill(void)
 {
-	if (M->t == NULL) {
-		M->t = M->b = obj;
-		M->t->prev = M->t->next = NULL;
-	} else {
-		M->t->prev = obj;
-		obj->next = M->t;
-		M->t = obj;
-		M->t->prev = NULL;
-	}
+	size_t page = sysconf(_SC_PAGESIZE), room, len;
+	char path[1024], *dir;
+	double *s;
+	int fresh = M->fd < 0;
 
-	M->d++;
+	if (fresh) {
+		if ((dir = getenv("TMPDIR")) == NULL)
+			dir = "/tmp";
+		snprintf(path, sizeof path, "%s/rpnstack.XXXXXX", dir);
+		if ((M->fd = mkstemp(path)) < 0) {
+			perror(path);
+			exit(1);
+		}
+		unlink(path);
+	}
+	len = M->room * sizeof *s + (memlimit > 0 ? memlimit / 2 :
+	    M->room * sizeof *s);
+	len = (len / page + 1) * page;
+	room = len / sizeof *s;
+	if (ftruncate(M->fd, len) < 0 ||
+	    (s = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, M->fd,
+	    0)) == MAP_FAILED) {
+		perror("Error: spill");
+		exit(1);
+	}
+	madvise(s, len, MADV_SEQUENTIAL);
+	if (fresh)
+		memcpy(s, M->s, M->d * sizeof *s);
+	if (M->map != NULL)
+		munmap(M->map, M->maplen);
+	else
+		free(M->s);
+	M->map = M->s = s;
+	M->maplen = len;
+	M->room = room;
+	trimstack();
 }
 
 void
-pushnum(double num)
+growstack(void)
 {
-	struct object *obj;
+	size_t room = M->room ? M->room * 2 : 64;
+	double *s;
 
-	if ((obj = malloc(sizeof *obj)) == NULL) {
-		perror("Error: malloc");
+	if (M->fd >= 0 || (memlimit > 0 && room * sizeof *s > memlimit / 2)) {
+		spill();
+		return;
+	}
+	if (M->map != NULL) {
+		if ((s = malloc(room * sizeof *s)) == NULL) {
+			perror("Error: malloc");
+			exit(1);
+		}
+		memcpy(s, M->s, M->d * sizeof *s);
+		munmap(M->map, M->maplen);
+		M->map = NULL;
+		M->maplen = 0;
+	} else if ((s = realloc(M->s, room * sizeof *s)) == NULL) {
+		perror("Error: realloc");
 		exit(1);
 	}
-	obj->num = num;
-	push(obj);
+	M->s = s;
+	M->room = room;
+}
+
+void
+pushnum(double num)
+{
+	if (M->d == M->room)
+		growstack();
+	M->s[M->d++] = num;
 }
 
 unsigned
 countstack(void)
 {
-	unsigned cnt = 0;
-	struct object *o = NULL;
-
-	for(o = top(); o; o = o->next)
-		cnt += 1;
+	return M->d;
+}
 
-	return cnt;
+double
+peeknthnum(unsigned off)
+{
+	return NTH(off);
 }
 
-struct object *
-pop(void)
+double
+popnum(void)
 {
-	struct object *obj;
+	return M->s[--M->d];
+}
 
-	obj = M->t;
-	if ((M->t = M->t->next) != NULL)
-		M->t->prev = NULL;
-	else
-		M->b = NULL;
-	M->d--;
-	return obj;
+/*
+ * Output.  printstk() formats into obuf and hands it to outfp in large
+ * writes rather than going through stdio once per number.
+ */
+
+#define OBUFSIZE	65536
+
+static __thread char obuf[OBUFSIZE];
+static __thread size_t olen;
+
+static void
+oflush(void)
+{
+	fwrite(obuf, 1, olen, outfp);
+	olen = 0;
 }
 
-double
-peeknthnum(unsigned off)
+static char *
+oreserve(size_t n)
 {
-	struct object *o = top();
+	if (olen + n > OBUFSIZE)
+		oflush();
+	return obuf + olen;
+}
+
+static const double pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-	while(off--)
-		o = o->next;
+static const char nums[] = "0123456789abcdefghijklmnopqrstuvwxyz";
 
-	return(o->num);
+/*
+ * Write the decimal digits of u backwards from end; return the start.
+ */
+static char *
+utoa(unsigned long long u, char *end)
+{
+	do
+		*--end = '0' + u % 10;
+	while ((u /= 10) != 0);
+	return end;
 }
 
-double
-popnum(void)
+/*
+ * Format num as printf's "%.*g" would with prec significant digits,
+ * into buf, and return the length.  Numbers that come out in fixed
+ * notation are scaled to an integer of prec digits and rounded; the
+ * scaling is exact to well within the guard band, and anything close
+ * enough to a rounding tie to be in doubt goes to snprintf() instead.
+ */
+static int
+fmtg(char *buf, double num, int prec)
 {
-	double num;
-	struct object *obj;
+	double a = fabs(num), m, f;
+	unsigned long long r;
+	char digs[24], *d, *p = buf;
+	int x, n;
+
+	if (a == 0 || !isfinite(a) || a < 1e-4 || a >= pow10[prec])
+		goto slow;
+	if (a == (unsigned long long)a) {
+		if (signbit(num))
+			*p++ = '-';
+		d = utoa((unsigned long long)a, digs + sizeof digs);
+		n = digs + sizeof digs - d;
+		memcpy(p, d, n);
+		return p + n - buf;
+	}
+
+	for (x = prec - 1; a < pow10[x]; x--)
+		if (x == 0) {
+			x = -1;
+			while (a * pow10[-x] < 1)
+				x--;
+			break;
+		}
+	m = a * pow10[prec - 1 - x];
+	f = m - floor(m);
+	if (fabs(f - 0.5) <= m * 1e-15 + 1e-300)
+		goto slow;
+	r = (unsigned long long)m + (f > 0.5);
+	if (r < pow10[prec - 1] || r >= pow10[prec])
+		goto slow;
+
+	if (signbit(num))
+		*p++ = '-';
+	d = utoa(r, digs + sizeof digs);
+	if (x < 0) {
+		*p++ = '0';
+		*p++ = '.';
+		for (n = x + 1; n < 0; n++)
+			*p++ = '0';
+		memcpy(p, d, prec);
+		p += prec;
+	} else {
+		memcpy(p, d, x + 1);
+		p += x + 1;
+		*p++ = '.';
+		memcpy(p, d + x + 1, prec - x - 1);
+		p += prec - x - 1;
+	}
+	while (p[-1] == '0')
+		p--;
+	if (p[-1] == '.')
+		p--;
+	return p - buf;
 
-	obj = pop();
-	num = obj->num;
-	free(obj);
-	return num;
+slow:
+	return snprintf(buf, 32, "%.*g", prec, num);
 }
 
-void
-popobj(struct object *obj)
+/*
+ * The shortest "%g" that reads back as num.  If 15 digits round-trip
+ * then so do the 15 digits with their trailing zeros dropped, and
+ * nothing shorter can, so at most three tries are needed.
+ */
+static int
+fmtshortest(char *buf, double num)
 {
-	if (obj == top())
-		pop();
-	else {
-		if (obj == M->b)
-			M->b = obj->prev;
-		else
-			obj->next->prev = obj->prev;
-		obj->prev->next = obj->next;
+	int prec, n;
 
-		M->d--;
+	if (fabs(num) < 1e17 && num == (long long)num)
+		return fmtg(buf, num, 17);
+	for (prec = 15; prec < 17; prec++) {
+		n = fmtg(buf, num, prec);
+		buf[n] = '\0';
+		if (strtod(buf, NULL) == num || isnan(num))
+			return n;
 	}
-	free(obj);
+	return fmtg(buf, num, 17);
 }
 
+/*
+ * Format num as an integer in base, padded to padto digits with zeros.
+ * In word mode num is a word, shown as worddigits() says.
+ */
 static void
-printnum(unsigned long num, int base, int padto)
+printnum(double num, int base, int padto)
 {
-	static char str[sizeof num * CHAR_BIT], *ptr = str;
-	static char nums[] = "0123456789abcdefghijklmnopqrstuvwxyz";
-	int padc = 0;
+	unsigned long u;
+	char str[sizeof u * CHAR_BIT], *ptr = str, *p;
+	int padc, shift;
 
-	do
-		*ptr++ = nums[num % base];
-	while ((num /= base) != 0);
+	if (wordsize == 0)
+		u = num < 0 ? (unsigned long)(long)num : (unsigned long)num;
+	else if (worddigits(num, base, &u)) {
+		*oreserve(1) = '-';
+		olen++;
+	}
+	if ((base & (base - 1)) == 0) {
+		shift = base == 2 ? 1 : base == 8 ? 3 : base == 16 ? 4 : base == 4 ? 2 : 5;
+		do
+			*ptr++ = nums[u & (base - 1)];
+		while ((u >>= shift) != 0);
+	} else {
+		do
+			*ptr++ = nums[u % base];
+		while ((u /= base) != 0);
+	}
 
-	padc = padto - (ptr - str);
-	while(padc > 0)
-		padc--, putchar('0');
+	for (padc = padto - (ptr - str); padc > 0; padc -= OBUFSIZE / 2) {
+		p = oreserve(OBUFSIZE / 2);
+		memset(p, '0', padc < OBUFSIZE / 2 ? padc : OBUFSIZE / 2);
+		olen += padc < OBUFSIZE / 2 ? padc : OBUFSIZE / 2;
+	}
 
+	p = oreserve(sizeof str * 2 + 1);
 	while (ptr > str) {
-		putchar(*--ptr);
-		if(base == 2 && ((unsigned long)ptr % 4) == 0)
-			putchar('.');
+		*p++ = *--ptr;
+		if(base == 2 && ((ptr - str) % 4) == 0)
+			*p++ = '.';
 	}
+	*p++ = ' ';
+	olen = p - obuf;
+}
 
-	putchar(' ');
+/*
+ * Format num in decimal with prec digits, or as few as read back the
+ * same if prec is 0, followed by a space.  Returns the end.
+ */
+static char *
+fmtdec(char *p, double num, int prec)
+{
+	if (prec == 0)
+		p += fmtshortest(p, num);
+	else
+		p += fmtg(p, num, prec);
+	*p++ = ' ';
+	return p;
 }
 
+/*
+ * A big stack in decimal is formatted on the thread pool, a chunk into
+ * each buffer, and the buffers are written out in order.  A spilled
+ * stack is done SPILLROUND chunks at a time, letting go of each round
+ * of the stack and its buffers before the next.
+ */
+#define SPILLROUND	16
+
+struct fmtjob {
+	const double *s;
+	size_t n, first;
+	int prec, stackmode;
+	char **buf;
+	size_t *len;
+};
+
 static void
+fmtchunk(void *arg, size_t i)
+{
+	struct fmtjob *j = arg;
+	size_t c = j->first + i, k;
+	size_t end = j->n - c * CHUNK < CHUNK ? j->n : (c + 1) * CHUNK;
+	char *p;
+
+	if ((p = j->buf[i] = malloc((end - c * CHUNK) * 42)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	for (k = c * CHUNK; k < end; k++) {
+		p = fmtdec(p, j->s[k], j->prec);
+		if (j->stackmode && k + 1 < j->n)
+			*p++ = '\n';
+	}
+	j->len[i] = p - j->buf[i];
+}
+
+static void
+printbig(void)
+{
+	struct fmtjob j;
+	size_t nchunks = (M->d + CHUNK - 1) / CHUNK, round, k, i;
+
+	round = M->fd >= 0 && nchunks > SPILLROUND ? SPILLROUND : nchunks;
+	j.s = M->s;
+	j.n = M->d;
+	j.prec = digits;
+	j.stackmode = stackmode;
+	if ((j.buf = malloc(round * sizeof *j.buf)) == NULL ||
+	    (j.len = malloc(round * sizeof *j.len)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	for (j.first = 0; j.first < nchunks; j.first += k) {
+		k = nchunks - j.first < round ? nchunks - j.first : round;
+		poolrun(k, fmtchunk, &j);
+		if (M->fd >= 0)
+			dropvalues(M->s + j.first * CHUNK,
+			    (j.first + k) * CHUNK < M->d ? k * CHUNK :
+			    M->d - j.first * CHUNK);
+		for (i = 0; i < k; i++) {
+			fwrite(j.buf[i], 1, j.len[i], outfp);
+			free(j.buf[i]);
+		}
+	}
+	trimstack();
+	free(j.buf);
+	free(j.len);
+}
+
+void
 printstk(char *prompt)
 {
-	struct object *obj;
+	size_t i;
 
-	for (obj = M->b; obj != NULL; obj = obj->prev) {
-		if (base == 10)
-			printf("%.12g ", obj->num);
+	if (base == 10 && wordsize == 0 && (bigjob(M->d) || M->fd >= 0)) {
+		printbig();
+		fputs(prompt, outfp);
+		return;
+	}
+	for (i = 0; i < M->d; i++) {
+		if (base == 10 && wordsize == 0)
+			olen = fmtdec(oreserve(40), M->s[i], digits) - obuf;
 		else
-			printnum(obj->num, base, padcount);
+			printnum(M->s[i], base, base == 10 ? 0 : padcount);
 
-		if(stackmode && obj->prev)
-			putchar('\n');
+		if(stackmode && i + 1 < M->d) {
+			*oreserve(1) = '\n';
+			olen++;
+		}
 	}
 
-	fputs(prompt, stdout);
+	oflush();
+	fputs(prompt, outfp);
+}
+
+#ifdef PROFILE
+/*
+ * Profiling.  Every command or macro that eval() runs pushes a frame;
+ * when it returns, its time goes to total and, less the time of the
+ * frames above it, to self.  A recursive macro counts its time once for
+ * each level.  The counters are shared by -j workers, so they are
+ * updated atomically.
+ */
+struct pframe {
+	struct prof *p;
+	unsigned long long start, child;
+};
+
+static __thread struct pframe *frames;
+static __thread size_t nframes, framesroom;
+
+#define PROFADD(x, n)	__atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+
+static unsigned long long
+nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 static void
-eval(char *cmd)
+enter(struct prof *p)
+{
+	struct pframe *f;
+
+	if (nframes == framesroom) {
+		framesroom = framesroom ? framesroom * 2 : 64;
+		if ((f = realloc(frames, framesroom * sizeof *f)) == NULL) {
+			perror("Error: realloc");
+			exit(1);
+		}
+		frames = f;
+	}
+	f = &frames[nframes++];
+	f->p = p;
+	f->child = 0;
+	PROFADD(p->calls, 1);
+	f->start = nsecs();
+}
+
+static void
+leave(void)
+{
+	struct pframe *f = &frames[--nframes];
+	unsigned long long t = nsecs() - f->start;
+
+	PROFADD(f->p->total, t);
+	PROFADD(f->p->self, t - f->child);
+	if (nframes > 0)
+		frames[nframes - 1].child += t;
+}
+
+/*
+ * Called by error(): charge the error to whatever is running.
+ */
+void
+profileerror(void)
+{
+	if (nframes > 0)
+		PROFADD(frames[nframes - 1].p->errors, 1);
+}
+
+#define ENTER(p)	enter(p)
+#define LEAVE()		leave()
+#else
+#define ENTER(p)
+#define LEAVE()
+#endif
+
+/*
+ * Run one command, or report an unknown one.
+ */
+static void
+eval(struct op *op)
 {
-	char *operation;
-	static int doingmacro = 0;
 	long numargs;
-	static char prevcmd[MAXSIZE] = { '\0' };
 	struct command *cmdptr;
+	double top;
+
+	if (op->type == OP_UNKNOWN || op->type == OP_BADCTL) {
+		thiscmd = op->u.name;
+		error(op->type == OP_BADCTL ? ERR_CONTROL : ERR_UNKNOWNCMD);
+		return;
+	}
+	cmdptr = op->u.cmd;
+	thiscmd = cmdptr->name;
+	ENTER(&cmdptr->prof);
+	if (cmdptr->numargs == -1) {
+		if (M->d == 0)
+			numargs = 1;
+		else if ((top = wordsize != 0 ? wordtonum(TOP) : TOP) < 0)
+			numargs = -1;
+		else
+			numargs = ceil(top) + 1;
+	} else
+		numargs = cmdptr->numargs;
+	if (numargs == -1 || M->d < numargs)
+		error(ERR_ARGC);
+	else if (wordsize != 0)
+		wordeval(cmdptr, numargs);
+	else
+		cmdptr->function();
+	LEAVE();
+}
+
+/*
+ * Macro calls do not recurse on the C stack.  Each one pushes a frame
+ * on the return stack rs, which saves the ops left to run in the caller
+ * and how many more times ip[-1] is to be repeated.  Calls nest at most
+ * maxdepth deep.
+ */
+struct ret {
+	struct op *ip, *end;
+	int left;
+#ifdef PROFILE
+	int prof;		/* entered a profiling frame */
+#endif
+};
+
+static __thread struct ret *rs;
+static __thread size_t rsdepth, rsroom;
+__thread size_t maxdepth = MAXDEPTH;
+
+static struct ret *
+call(struct code *c)
+{
+	struct ret *r;
 
-	if (!doingmacro) {
-		if (strcmp(cmd, ".") == 0 && prevcmd[0])
-			cmd = prevcmd;
-		else {
-			strncpy(prevcmd, cmd, MAXSIZE-1);
-			cmd[MAXSIZE-1] = 0;
+	if (rsdepth == rsroom) {
+		rsroom = rsroom ? rsroom * 2 : 64;
+		if ((r = realloc(rs, rsroom * sizeof *r)) == NULL) {
+			perror("Error: realloc");
+			exit(1);
 		}
+		rs = r;
 	}
+	r = &rs[rsdepth++];
+	r->ip = c->ops;
+	r->end = c->ops + c->n;
+	r->left = 0;
+#ifdef PROFILE
+	r->prof = 0;
+#endif
+	return r;
+}
 
-	if ((operation = findmacro(cmd)) != NULL) {
-		doingmacro = 1;
-		process(operation);
-		doingmacro = 0;
-	} else if ((cmdptr = findcmd(cmd)) != NULL) {
-		if (cmdptr->numargs == -1) {
-			if (top() == NULL)
-				numargs = 1;
-			else if (top()->num < 0)
-				numargs = -1;
-			else
-				numargs = top()->num + 1;
-		} else
-			numargs = cmdptr->numargs;
-		if (numargs == -1 || M->d < numargs)
-			error(ERR_ARGC);
+/*
+ * Counters of the start and for loops that are running.  Each belongs
+ * to the frame that started it and ends when that frame returns.
+ */
+struct loop {
+	double i, to;
+	size_t frame;
+};
+
+static __thread struct loop *loops;
+static __thread size_t nloops, loopsroom;
+
+static void
+ret(void)
+{
+#ifdef PROFILE
+	if (rs[rsdepth - 1].prof)
+		leave();
+#endif
+	rsdepth--;
+	while (nloops > 0 && loops[nloops - 1].frame >= rsdepth)
+		nloops--;
+}
+
+/*
+ * Pop the top of the stack as a number, or push one, in word mode too.
+ */
+static double
+popvalue(void)
+{
+	double num = popnum();
+
+	return wordsize != 0 ? wordtonum(num) : num;
+}
+
+static void
+pushvalue(double num)
+{
+	pushnum(wordsize != 0 ? numtoword(num) : num);
+}
+
+static char *ctlname[] = {
+	[OP_JMP] = "else", [OP_IF] = "if", [OP_WHILE] = "while",
+	[OP_UNTIL] = "until", [OP_START] = "start", [OP_FOR] = "for",
+	[OP_NEXT] = "next", [OP_STEP] = "step", [OP_LOOPVAR] = "for"
+};
+
+/*
+ * The control ops that run() does not do itself: starting a loop,
+ * step, and the errors of if, while and until.  Loops always run their
+ * body at least once.
+ */
+static void
+control(struct op *op, struct op **ip)
+{
+	struct loop *l;
+	double step;
+
+	switch (op->type) {
+	case OP_START:
+	case OP_FOR:
+		if (M->d < 2)
+			break;
+		if (nloops == loopsroom) {
+			loopsroom = loopsroom ? loopsroom * 2 : 16;
+			if ((l = realloc(loops, loopsroom * sizeof *l)) == NULL) {
+				perror("Error: realloc");
+				exit(1);
+			}
+			loops = l;
+		}
+		l = &loops[nloops++];
+		l->to = popvalue();
+		l->i = popvalue();
+		l->frame = rsdepth - 1;
+		return;
+	case OP_STEP:
+		if (M->d < 1)
+			break;
+		step = popvalue();
+		l = &loops[nloops - 1];
+		l->i += step;
+		if (step >= 0 ? l->i <= l->to : l->i >= l->to)
+			*ip = op + op->u.to;
 		else
-			cmdptr->function();
+			nloops--;
+		return;
+	}
+	thiscmd = ctlname[op->type];
+	error(ERR_ARGC);
+}
+
+/*
+ * How many ops each inline or fused op stands for.
+ */
+static const unsigned char opspan[NUMOPS] = {
+	[OP_ADD] = 1, [OP_SUB] = 1, [OP_MUL] = 1, [OP_DIV] = 1,
+	[OP_DUP] = 1, [OP_SWAP] = 1, [OP_DROP] = 1, [OP_INC] = 1,
+	[OP_DEC] = 1, [OP_SQUARE] = 2, [OP_RSUB] = 2, [OP_RDIV] = 2,
+	[OP_ADDK] = 2, [OP_SUBK] = 2, [OP_MULK] = 2, [OP_DIVK] = 2,
+	[OP_POWK] = 2, [OP_PICKK] = 2, [OP_ROLLK] = 2, [OP_INV] = 3
+};
+
+/*
+ * The fast path of an inline or fused op: do what its ops would do, if
+ * that cannot fail and nothing is being repeated, and return 1.  run()
+ * passes type as a constant so that only one case is compiled in.
+ */
+static inline int
+fast(struct op *op, int type)
+{
+	double k, *obj;
+	size_t n;
+
+	if (repeat != 1 || wordsize != 0)
+		return 0;
+	switch (type) {
+	case OP_ADD:
+		if (M->d < 2)
+			return 0;
+		NTH(1) += TOP;
+		M->d--;
+		return 1;
+	case OP_SUB:
+		if (M->d < 2)
+			return 0;
+		NTH(1) -= TOP;
+		M->d--;
+		return 1;
+	case OP_MUL:
+		if (M->d < 2)
+			return 0;
+		NTH(1) *= TOP;
+		M->d--;
+		return 1;
+	case OP_DIV:
+		if (M->d < 2 || TOP == 0)
+			return 0;
+		NTH(1) /= TOP;
+		M->d--;
+		return 1;
+	case OP_DUP:
+		if (M->d < 1)
+			return 0;
+		pushnum(TOP);
+		return 1;
+	case OP_SWAP:
+		if (M->d < 2)
+			return 0;
+		k = NTH(1);
+		NTH(1) = TOP;
+		TOP = k;
+		return 1;
+	case OP_DROP:
+		if (M->d < 1)
+			return 0;
+		M->d--;
+		return 1;
+	case OP_INC:
+		if (M->d < 1)
+			return 0;
+		TOP++;
+		return 1;
+	case OP_DEC:
+		if (M->d < 1)
+			return 0;
+		TOP--;
+		return 1;
+	case OP_SQUARE:
+		if (M->d < 1)
+			return 0;
+		TOP *= TOP;
+		return 1;
+	case OP_RSUB:
+		if (M->d < 2)
+			return 0;
+		NTH(1) = TOP - NTH(1);
+		M->d--;
+		return 1;
+	case OP_RDIV:
+		if (M->d < 2 || NTH(1) == 0)
+			return 0;
+		NTH(1) = TOP / NTH(1);
+		M->d--;
+		return 1;
+	case OP_ADDK:
+		if (M->d < 1)
+			return 0;
+		TOP += op->u.num;
+		return 1;
+	case OP_SUBK:
+		if (M->d < 1)
+			return 0;
+		TOP -= op->u.num;
+		return 1;
+	case OP_MULK:
+		if (M->d < 1)
+			return 0;
+		TOP *= op->u.num;
+		return 1;
+	case OP_DIVK:
+		if (M->d < 1 || op->u.num == 0)
+			return 0;
+		TOP /= op->u.num;
+		return 1;
+	case OP_POWK:
+		k = op->u.num;
+		if (M->d < 1 || (TOP == 0 && k <= 0) ||
+		    (TOP < 0 && k != floor(k)))
+			return 0;
+		TOP = pow(TOP, k);
+		return 1;
+	case OP_PICKK:
+		if (M->d < op->u.num)
+			return 0;
+		pushnum(NTH((size_t)op->u.num - 1));
+		return 1;
+	case OP_ROLLK:
+		if (M->d < op->u.num)
+			return 0;
+		n = (size_t)op->u.num - 1;
+		obj = &NTH(n);
+		k = *obj;
+		memmove(obj, obj + 1, n * sizeof *obj);
+		TOP = k;
+		return 1;
+	case OP_INV:
+		if (M->d < 1 || TOP == 0)
+			return 0;
+		TOP = 1 / TOP;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Is c one inline or fused op, so that calling it as a macro can be
+ * done by its fast path alone?
+ */
+int
+isleaf(struct code *c)
+{
+	return c->n > 0 && opspan[c->ops[0].type] == c->n;
+}
+
+/*
+ * Dispatch.  With GNU C each op jumps straight to the code for the next
+ * one through a table of label addresses; elsewhere run() is a switch in
+ * a loop.  CASE() makes both the case and the label, and NEXT goes on to
+ * the next op.  Build with -DNOTHREADED to try the switch.
+ */
+#if defined(__GNUC__) && !defined(NOTHREADED)
+#define THREADED
+#endif
+
+#ifdef THREADED
+#define CASEL(t, l)	case t: l
+#define NEXT		do {						\
+				if (ip == end)				\
+					goto out;			\
+				op = ip++;				\
+				goto *labels[op->type];			\
+			} while (0)
+#else
+#define CASEL(t, l)	case t
+#define NEXT		continue
+#endif
+#define CASE(t)		CASEL(t, L_##t)
+
+/* a false condition; the one word with the bits of -0 is not zero */
+#define ISZERO(x)	((x) == 0 && (wordsize == 0 || !signbit(x)))
+
+/* an inline or fused op whose first op was a command or a number */
+#define FASTCMD(t)	CASEL(t, L_##t):					\
+			if (!fast(op, t))				\
+				goto cmd;				\
+			ip += opspan[t] - 1;				\
+			NEXT
+#define FASTNUM(t)	CASEL(t, L_##t):					\
+			if (!fast(op, t))				\
+				goto num;				\
+			ip += opspan[t] - 1;				\
+			NEXT
+
+/*
+ * Run compiled code.  An error abandons the rest of the innermost code,
+ * but not the code of whatever macro called it.  A macro called as the
+ * last thing its caller does takes over the caller's frame, so a macro
+ * that ends by calling itself runs in constant space.  Nesting deeper
+ * than maxdepth is an error that abandons everything run() was given.
+ */
+void
+run(struct code *c)
+{
+#ifdef THREADED
+	static void *labels[NUMOPS] = {
+		&&L_OP_NUM, &&L_OP_CMD, &&L_OP_MACRO, &&L_OP_UNKNOWN,
+		&&L_OP_BADCTL, &&L_OP_JMP, &&L_OP_IF, &&L_OP_WHILE,
+		&&L_OP_UNTIL, &&L_OP_START, &&L_OP_FOR, &&L_OP_NEXT,
+		&&L_OP_STEP, &&L_OP_LOOPVAR, &&L_OP_ADD, &&L_OP_SUB,
+		&&L_OP_MUL, &&L_OP_DIV, &&L_OP_DUP, &&L_OP_SWAP,
+		&&L_OP_DROP, &&L_OP_INC, &&L_OP_DEC, &&L_OP_SQUARE,
+		&&L_OP_RSUB, &&L_OP_RDIV, &&L_OP_ADDK, &&L_OP_SUBK,
+		&&L_OP_MULK, &&L_OP_DIVK, &&L_OP_POWK, &&L_OP_PICKK,
+		&&L_OP_ROLLK, &&L_OP_INV, &&L_OP_MAP, &&L_OP_MAPCMD,
+		&&L_OP_SAVE, &&L_OP_LOAD, &&L_OP_INT, &&L_OP_NEGINT
+	};
+#endif
+	size_t bottom = rsdepth;
+	struct ret *r = call(c);
+	struct op *ip = r->ip, *end = r->end, *op;
+	struct macro *macro;
+	struct loop *l;
+	int x;
+
+	for (;;) {
+		if (ip == end) {
+	out:
+			ret();
+			if (rsdepth == bottom)
+				return;
+			r = &rs[rsdepth - 1];
+			ip = r->ip;
+			end = r->end;
+			if (r->left == 0)
+				continue;
+			r->left--;
+			op = ip - 1;
+			goto callmacro;
+		}
+
+		op = ip++;
+		switch (op->type) {
+		CASE(OP_NUM):
+	num:
+			pushvalue(op->u.num);
+			NEXT;
+
+		CASE(OP_INT):
+		CASE(OP_NEGINT):
+			pushnum(intcell(op->u.word, op->type == OP_NEGINT));
+			NEXT;
+
+		CASE(OP_CMD):
+		CASE(OP_UNKNOWN):
+		CASE(OP_BADCTL):
+	cmd:
+			x = repeat;
+			repeat = 1;
+			for (; x > 0; x--) {
+				eval(op);
+				if (stop)
+					goto failed;
+			}
+			NEXT;
+
+		FASTCMD(OP_ADD);
+		FASTCMD(OP_SUB);
+		FASTCMD(OP_MUL);
+		FASTCMD(OP_DIV);
+		FASTCMD(OP_DUP);
+		FASTCMD(OP_SWAP);
+		FASTCMD(OP_DROP);
+		FASTCMD(OP_INC);
+		FASTCMD(OP_DEC);
+		FASTCMD(OP_SQUARE);
+		FASTCMD(OP_RSUB);
+		FASTCMD(OP_RDIV);
+		FASTNUM(OP_ADDK);
+		FASTNUM(OP_SUBK);
+		FASTNUM(OP_MULK);
+		FASTNUM(OP_DIVK);
+		FASTNUM(OP_POWK);
+		FASTNUM(OP_PICKK);
+		FASTNUM(OP_ROLLK);
+		FASTNUM(OP_INV);
+
+		CASE(OP_JMP):
+			ip = op + op->u.to;
+			NEXT;
+
+		CASE(OP_IF):
+		CASE(OP_WHILE):
+		CASE(OP_UNTIL):
+			if (M->d == 0)
+				goto control;
+			M->d--;
+			if (ISZERO(M->s[M->d]))
+				ip = op + op->u.to;
+			NEXT;
+
+		CASE(OP_NEXT):
+			l = &loops[nloops - 1];
+			if (++l->i <= l->to)
+				ip = op + op->u.to;
+			else
+				nloops--;
+			NEXT;
+
+		CASE(OP_LOOPVAR):
+			pushvalue(loops[nloops - 1 - op->u.to].i);
+			NEXT;
+
+		CASE(OP_START):
+		CASE(OP_FOR):
+		CASE(OP_STEP):
+	control:
+			control(op, &ip);
+			if (stop)
+				goto failed;
+			NEXT;
+
+		CASE(OP_MAP):
+		CASE(OP_MAPCMD):
+			x = repeat;
+			repeat = 1;
+			for (; x > 0; x--) {
+				map(op);
+				if (stop)
+					break;
+			}
+			/* map() may have run code and moved the return stack */
+			r = &rs[rsdepth - 1];
+			if (x > 0)
+				goto failed;
+			NEXT;
+
+		CASE(OP_SAVE):
+		CASE(OP_LOAD):
+			repeat = 1;
+			if (op->type == OP_SAVE)
+				savestack(op->u.name);
+			else
+				loadstack(op->u.name, 0);
+			if (stop)
+				goto failed;
+			NEXT;
+
+		failed:
+			/* an error ends the macro it is in, or with abandon, all */
+			stop = 0;
+			if (!abandon)
+				goto out;
+			while (rsdepth > bottom)
+				ret();
+			return;
+
+		CASE(OP_MACRO):
+			x = repeat;
+			repeat = 1;
+			if (x <= 0)
+				NEXT;
+			r->left = x - 1;
+			break;
+		}
+
+	callmacro:
+		macro = op->u.macro;
+		if (macro->gen != macrogen)
+			compilemacro(macro);
+		if (macro->leaf && r->left == 0 &&
+		    fast(macro->code.ops, macro->code.ops->type))
+			NEXT;
+		if (ip == end && r->left == 0) {
+#ifdef PROFILE
+			if (r->prof)
+				leave();
+#endif
+		} else if (rsdepth >= maxdepth) {
+			thiscmd = macro->name;
+			error(ERR_DEPTH);
+			stop = 0;
+			while (rsdepth > bottom)
+				ret();
+			return;
+		} else {
+			r->ip = ip;
+			r->end = end;
+			r = call(&macro->code);
+		}
+		ip = macro->code.ops;
+		end = macro->code.ops + macro->code.n;
+#ifdef PROFILE
+		enter(&macro->prof);
+		r->prof = 1;
+#endif
+	}
+}
+
+static struct op *
+emit(struct code *c, int type)
+{
+	if (c->n == c->room) {
+		size_t room = c->room ? c->room * 2 : 16;
+		struct op *ops;
+
+		if ((ops = realloc(c->ops, room * sizeof *ops)) == NULL) {
+			perror("Error: realloc");
+			exit(1);
+		}
+		c->ops = ops;
+		c->room = room;
+	}
+	c->ops[c->n].type = type;
+	return &c->ops[c->n++];
+}
+
+static void
+emitword(struct code *c, char *word)
+{
+	struct macro *macro;
+	struct command *cmdptr;
+
+	if ((macro = findmacro(word)) != NULL)
+		emit(c, OP_MACRO)->u.macro = macro;
+	else if ((cmdptr = findcmd(word)) != NULL)
+		emit(c, OP_CMD)->u.cmd = cmdptr;
+	else if ((emit(c, OP_UNKNOWN)->u.name = strdup(word)) == NULL) {
+		perror("Error: strdup");
+		exit(1);
+	}
+}
+
+/*
+ * The words that take the next word as their operand, and compiling
+ * that word: the macro or command name after map, or the file name
+ * after save or load.
+ */
+static char *prefixes[] = { "map", "save", "load" };
+#define NUMPREFIXES (sizeof prefixes / sizeof *prefixes)
+
+static char *
+isprefix(char *w)
+{
+	size_t i;
+
+	for (i = 0; i < NUMPREFIXES; i++)
+		if (strcmp(w, prefixes[i]) == 0)
+			return prefixes[i];
+	return NULL;
+}
+
+static void
+prefixed(struct code *c, char *prefix, char *word)
+{
+	struct macro *macro;
+	struct command *cmdptr;
+	int type = OP_UNKNOWN;
+
+	if (prefix[0] == 'm') {
+		if ((macro = findmacro(word)) != NULL) {
+			emit(c, OP_MAP)->u.macro = macro;
+			return;
+		}
+		if ((cmdptr = findcmd(word)) != NULL) {
+			emit(c, OP_MAPCMD)->u.cmd = cmdptr;
+			return;
+		}
 	} else
-		error(ERR_UNKNOWNCMD);
+		type = prefix[0] == 's' ? OP_SAVE : OP_LOAD;
+	if ((emit(c, type)->u.name = strdup(word)) == NULL) {
+		perror("Error: strdup");
+		exit(1);
+	}
+}
+
+#define HASNAME(t)	((t) == OP_UNKNOWN || (t) == OP_BADCTL ||	\
+			 (t) == OP_SAVE || (t) == OP_LOAD)
+
+void
+freecode(struct code *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->n; i++)
+		if (HASNAME(c->ops[i].type))
+			free(c->ops[i].u.name);
+	c->n = 0;
 }
 
 #define isnum(s) (isdigit(s[0])						\
@@ -211,132 +1200,772 @@ eval(char *cmd)
 #define isnotfloat(s) ((s[0] == '0' && s[1] != '.')			\
 		       || (s[0] == '-' && s[1] == '0' && s[2] != '.'))
 
+/*
+ * Numbers are lexed in one pass over the word.  Commas may appear
+ * anywhere in a number and are skipped.  The common forms, decimal
+ * integers and decimals with up to 19 significant digits and a small
+ * exponent, and integers in any base, are converted here.  Anything
+ * else goes to slownum(), which strips the commas and uses the C
+ * library the way rpn always has, so every number comes out the same
+ * as strtod() and friends would give.
+ */
+
+#define SKIPCOMMAS(p)	while (*(p) == ',') (p)++
+#define MAXEXACT	9007199254740992.0	/* 2^53 */
+
+static int
+digitval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 10;
+	return 36;
+}
+
+/*
+ * Read base digits from *pp into *u, skipping commas.  Returns the
+ * number of digits, or -1 if the value does not fit.
+ */
+static int
+lexdigits(char **pp, int base, unsigned long long *u)
+{
+	char *p = *pp;
+	unsigned long long v = 0;
+	int d, n = 0;
+
+	for (;; p++) {
+		SKIPCOMMAS(p);
+		if ((d = digitval(*p)) >= base)
+			break;
+		if (v > (ULLONG_MAX - d) / base)
+			return -1;
+		v = v * base + d;
+		n++;
+	}
+	*pp = p;
+	*u = v;
+	return n;
+}
+
+/*
+ * Turn a magnitude u and sign into a number the way strtol() or
+ * strtoul() followed by a conversion to double would.
+ */
+static int
+intnum(unsigned long long u, int neg, double *num)
+{
+	if (neg) {
+		if (u > (unsigned long long)LONG_MAX + 1)
+			return 0;
+		*num = u ? -(double)u : 0;	/* strtol() gives 0 for -0 */
+	} else {
+		if (u > ULONG_MAX)
+			return 0;
+		*num = u;
+	}
+	return 1;
+}
+
+/*
+ * Strip the commas from w, or from the part of it before hash, and
+ * convert it with the C library.
+ */
 static void
-process(char *str)
+slownum(char *w, char *hash, double *num, char **end)
 {
-	int x;
-	char *suffix, word[100];
-        char *tmp, *tmp2;
+	char small[64], *buf = small, *s, *p, *e;
+	size_t len = hash ? (size_t)(hash - w) : strlen(w);
+
+	if (len >= sizeof small && (buf = malloc(len + 1)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	for (s = buf, p = w; p < w + len; p++)
+		if (*p != ',')
+			*s++ = *p;
+	*s = '\0';
+
+	if (hash != NULL) {
+		if (buf[0] == '-')
+			*num = strtol(buf, NULL, atoi(hash + 1));
+		else
+			*num = strtoul(buf, NULL, atoi(hash + 1));
+		*end = hash + strlen(hash);
+	} else {
+		if (isnotfloat(buf)) {
+			if (buf[0] == '-')
+				*num = strtol(buf, &e, 0);
+			else
+				*num = strtoul(buf, &e, 0);
+		} else
+			*num = strtod(buf, &e);
+
+		/* find the same place in w */
+		for (p = w, s = buf; s < e; p++)
+			if (*p != ',')
+				s++;
+		SKIPCOMMAS(p);
+		*end = p;
+	}
+
+	if (buf != small)
+		free(buf);
+}
+
+/*
+ * NUMBER#BASE: the digits before the BASECHAR in the base after it.
+ * Like strtol(), anything after the digits is ignored.
+ */
+static int
+lexbase(char *w, char *hash, double *num)
+{
+	char *p = hash + 1;
+	int base = 0, neg = 0;
+	unsigned long long u;
+
+	while (*p >= '0' && *p <= '9' && base <= 36)
+		base = base * 10 + *p++ - '0';
+	if (*p != '\0' || base < 2 || base > 36)
+		return 0;
+
+	p = w;
+	if (*p == '-')
+		neg = 1, p++;
+	SKIPCOMMAS(p);
+	if (digitval(*p) >= base || (base == 16 && *p == '0' &&
+	    (p[1] == 'x' || p[1] == 'X' || p[1] == ',')))
+		return 0;
+	if (lexdigits(&p, base, &u) < 0)
+		return 0;
+	return intnum(u, neg, num);
+}
+
+/*
+ * An integer with a leading 0: octal, or hex after 0x.
+ */
+static int
+lexint(char *p, int neg, double *num, char **end)
+{
+	char *q = p + 1;
+	unsigned long long u;
+
+	SKIPCOMMAS(q);
+	if (*q == 'x' || *q == 'X') {
+		q++;
+		SKIPCOMMAS(q);
+		if (digitval(*q) < 16) {
+			if (lexdigits(&q, 16, &u) < 0)
+				return 0;
+			*end = q;
+			return intnum(u, neg, num);
+		}
+	}
+	if (lexdigits(&p, 8, &u) < 0)
+		return 0;
+	*end = p;
+	return intnum(u, neg, num);
+}
+
+/*
+ * A decimal number.  With at most 19 significant digits, a mantissa
+ * below 2^53 and a power of ten that is itself exact, one multiply or
+ * divide gives the correctly rounded result.
+ */
+static int
+lexdec(char *p, int neg, double *num, char **end)
+{
+	unsigned long long m = 0;
+	int ndig = 0, e10 = 0, exp = 0, eneg = 0, d;
+	char *q;
+
+	for (;; p++) {
+		SKIPCOMMAS(p);
+		if ((d = *p - '0') < 0 || d > 9)
+			break;
+		if (ndig == 19)
+			return 0;
+		if (m != 0 || d != 0)
+			m = m * 10 + d, ndig++;
+	}
+	if (*p == '.') {
+		for (p++;; p++) {
+			SKIPCOMMAS(p);
+			if ((d = *p - '0') < 0 || d > 9)
+				break;
+			if (ndig == 19)
+				return 0;
+			if (m != 0 || d != 0)
+				m = m * 10 + d, ndig++;
+			e10--;
+		}
+	}
+	if (*p == 'e' || *p == 'E') {
+		q = p + 1;
+		SKIPCOMMAS(q);
+		if (*q == '-' || *q == '+')
+			eneg = *q++ == '-';
+		SKIPCOMMAS(q);
+		if (*q >= '0' && *q <= '9') {
+			for (;; q++) {
+				SKIPCOMMAS(q);
+				if ((d = *q - '0') < 0 || d > 9)
+					break;
+				if (exp < 10000)
+					exp = exp * 10 + d;
+			}
+			e10 += eneg ? -exp : exp;
+			p = q;
+		}
+	}
+
+	if (m > MAXEXACT || e10 < -22 || e10 > 22)
+		return 0;
+	*num = e10 < 0 ? m / pow10[-e10] : m * pow10[e10];
+	if (neg)
+		*num = -*num;
+	*end = p;
+	return 1;
+}
+
+/*
+ * If the word w is, or starts with, a number, store the number in *num
+ * and point *end just past it.  Anything with a BASECHAR in it is a
+ * number in the base that follows the BASECHAR.
+ */
+static int
+lexnum(char *w, double *num, char **end)
+{
+	char *hash, *p, *q;
+	int neg;
+
+	if ((hash = strchr(w, BASECHAR)) != NULL) {
+		if (lexbase(w, hash, num))
+			*end = hash + strlen(hash);
+		else
+			slownum(w, hash, num, end);
+		return 1;
+	}
+	if (!isnum(w))
+		return 0;
+
+	p = w;
+	if ((neg = *p == '-'))
+		p++;
+	SKIPCOMMAS(p);
+	q = p + 1;
+	SKIPCOMMAS(q);
+	if (*p == '0' && *q != '.') {
+		if (!lexint(p, neg, num, end))
+			slownum(w, NULL, num, end);
+	} else if (!lexdec(p, neg, num, end))
+		slownum(w, NULL, num, end);
+	return 1;
+}
+
+/*
+ * If w, up to the end lexnum() found, is an integer that fits in 64
+ * bits, store its magnitude in *u and its sign in *neg.  Negative ones
+ * go down to -2^63, as they do for lexnum().
+ */
+static int
+lexinteger(char *w, char *end, unsigned long long *u, int *neg)
+{
+	char *p = w, *hash = strchr(w, BASECHAR), *q;
+	int base = 10;
+
+	if ((*neg = *p == '-'))
+		p++;
+	SKIPCOMMAS(p);
+	if (hash != NULL) {
+		base = atoi(hash + 1);
+		end = hash;
+	} else if (*p == '0') {
+		q = p + 1;
+		SKIPCOMMAS(q);
+		if (*q == 'x' || *q == 'X') {
+			p = q + 1;
+			base = 16;
+		} else
+			base = 8;
+	}
+	if (base < 2 || base > 36 || lexdigits(&p, base, u) <= 0 || p != end)
+		return 0;
+	return !*neg || *u <= (unsigned long long)LONG_MAX + 1;
+}
+
+/*
+ * Is the whole word w a number?
+ */
+int
+parsenum(char *w, double *num)
+{
+	char *end;
+
+	return lexnum(w, num, &end) && *end == '\0';
+}
+
+/*
+ * Control structures are compiled to jumps.  ctls holds the ones still
+ * open: at is the op that begins the structure or jumps out of it, jz
+ * the jump of a while, and var the name a for loop binds.
+ */
+#define CTL_IF		0
+#define CTL_ELSE	1
+#define CTL_BEGIN	2
+#define CTL_WHILE	3
+#define CTL_DO		4
+#define CTL_UNTIL	5
+#define CTL_LOOP	6
+
+struct ctl {
+	int kind;
+	size_t at, jz;
+	char *var;
+};
+
+static __thread struct ctl *ctls;
+static __thread size_t nctls, ctlsroom;
+
+static char *ctlopen[] = {
+	"if", "else", "begin", "while", "do", "until", "start"
+};
+
+static void
+pushctl(int kind, size_t at)
+{
+	struct ctl *t;
+
+	if (nctls == ctlsroom) {
+		ctlsroom = ctlsroom ? ctlsroom * 2 : 16;
+		if ((t = realloc(ctls, ctlsroom * sizeof *t)) == NULL) {
+			perror("Error: realloc");
+			exit(1);
+		}
+		ctls = t;
+	}
+	t = &ctls[nctls++];
+	t->kind = kind;
+	t->at = at;
+	t->var = NULL;
+}
+
+static void
+popctl(void)
+{
+	free(ctls[--nctls].var);
+}
+
+/* What compile() carries from one top-level line to the next */
+static __thread char *prevcmd;	/* the command word "." stands for */
+static __thread char *want;	/* the prefix waiting for its word */
+static __thread int wantvar;	/* a for waiting for its variable */
 
-	while (*str != '\0') {
+/*
+ * Forget what earlier lines left for compile(), so that a new client
+ * or program starts as a new rpn does.
+ */
+void
+resetcompile(void)
+{
+	while (nctls > 0)
+		popctl();
+	free(prevcmd);
+	prevcmd = want = NULL;
+	wantvar = 0;
+}
+
+static void
+jump(struct code *c, size_t from, size_t to)
+{
+	c->ops[from].u.to = (long)to - (long)from;
+}
+
+/*
+ * Compile w if it is a control word.  Returns 0 if it is not, and -1
+ * if it does not fit the structures open so far.
+ */
+static int
+ctlword(struct code *c, char *w)
+{
+	struct ctl *t = nctls > 0 ? &ctls[nctls - 1] : NULL;
+	int kind = t != NULL ? t->kind : -1;
+
+	if (strcmp(w, "if") == 0) {
+		pushctl(CTL_IF, c->n);
+		emit(c, OP_IF);
+	} else if (strcmp(w, "else") == 0) {
+		if (kind != CTL_IF)
+			return -1;
+		emit(c, OP_JMP);
+		jump(c, t->at, c->n);
+		t->kind = CTL_ELSE;
+		t->at = c->n - 1;
+	} else if (strcmp(w, "begin") == 0)
+		pushctl(CTL_BEGIN, c->n);
+	else if (strcmp(w, "while") == 0) {
+		if (kind != CTL_BEGIN)
+			return -1;
+		emit(c, OP_WHILE);
+		t->kind = CTL_WHILE;
+		t->jz = c->n - 1;
+	} else if (strcmp(w, "do") == 0)
+		pushctl(CTL_DO, c->n);
+	else if (strcmp(w, "until") == 0) {
+		if (kind != CTL_DO)
+			return -1;
+		t->kind = CTL_UNTIL;
+	} else if (strcmp(w, "end") == 0) {
+		if (kind == CTL_IF || kind == CTL_ELSE)
+			jump(c, t->at, c->n);
+		else if (kind == CTL_WHILE) {
+			emit(c, OP_JMP);
+			jump(c, c->n - 1, t->at);
+			jump(c, t->jz, c->n);
+		} else if (kind == CTL_UNTIL) {
+			emit(c, OP_UNTIL);
+			jump(c, c->n - 1, t->at);
+		} else
+			return -1;
+		popctl();
+	} else if (strcmp(w, "start") == 0 || strcmp(w, "for") == 0) {
+		emit(c, w[0] == 's' ? OP_START : OP_FOR);
+		pushctl(CTL_LOOP, c->n);
+	} else if (strcmp(w, "next") == 0 || strcmp(w, "step") == 0) {
+		if (kind != CTL_LOOP)
+			return -1;
+		emit(c, w[0] == 'n' ? OP_NEXT : OP_STEP);
+		jump(c, c->n - 1, t->at);
+		popctl();
+	} else
+		return 0;
+	return 1;
+}
+
+/*
+ * Compile w if it names the counter of an enclosing for loop.
+ */
+static int
+loopvar(struct code *c, char *w)
+{
+	size_t i, n = 0;
+
+	for (i = nctls; i-- > 0;) {
+		if (ctls[i].kind != CTL_LOOP)
+			continue;
+		if (ctls[i].var != NULL && strcmp(ctls[i].var, w) == 0) {
+			emit(c, OP_LOOPVAR)->u.to = n;
+			return 1;
+		}
+		n++;
+	}
+	return 0;
+}
+
+/*
+ * Peephole pass over the ops compiled from start on: turn the commands
+ * that have inline ops into them, and the first op of a common sequence
+ * into a fused op for the whole sequence.  A sequence is not fused
+ * across a jump target.  Under PROFILE everything is left as it is, so
+ * that every command is counted.
+ */
+
+#ifndef PROFILE
+static struct {
+	char *name;
+	int type;
+} inlines[] = {
+	{ "+", OP_ADD }, { "-", OP_SUB }, { "*", OP_MUL }, { "/", OP_DIV },
+	{ "dup", OP_DUP }, { "swap", OP_SWAP }, { "drop", OP_DROP },
+	{ "++", OP_INC }, { "--", OP_DEC }
+};
+#define NUMINLINES (sizeof inlines / sizeof *inlines)
+
+static int
+iscmd(struct op *op, char *name)
+{
+	return op != NULL && op->type == OP_CMD &&
+	    strcmp(op->u.cmd->name, name) == 0;
+}
+
+#endif
+
+static void
+fuse(struct code *c, size_t start)
+{
+#ifndef PROFILE
+	struct op *op, *next, *third;
+	char *target;
+	size_t i;
+	double k;
+
+	if ((target = calloc(c->n + 1, 1)) == NULL) {
+		perror("Error: calloc");
+		exit(1);
+	}
+	for (i = start; i < c->n; i++)
+		switch (c->ops[i].type) {
+		case OP_JMP: case OP_IF: case OP_WHILE: case OP_UNTIL:
+		case OP_NEXT: case OP_STEP:
+			target[i + c->ops[i].u.to] = 1;
+			break;
+		}
+
+	for (i = start; i < c->n; i++) {
+		op = &c->ops[i];
+		next = i + 1 < c->n && !target[i + 1] ? op + 1 : NULL;
+		third = next && i + 2 < c->n && !target[i + 2] ? op + 2 : NULL;
+		if (op->type == OP_NUM) {
+			k = op->u.num;
+			if (iscmd(next, "+"))
+				op->type = OP_ADDK;
+			else if (iscmd(next, "-"))
+				op->type = OP_SUBK;
+			else if (iscmd(next, "*"))
+				op->type = OP_MULK;
+			else if (iscmd(next, "/"))
+				op->type = OP_DIVK;
+			else if (iscmd(next, "pow"))
+				op->type = OP_POWK;
+			else if (k >= 1 && k <= 1e9 && k == floor(k) &&
+			    iscmd(next, "pick"))
+				op->type = OP_PICKK;
+			else if (k >= 1 && k <= 1e9 && k == floor(k) &&
+			    iscmd(next, "roll"))
+				op->type = OP_ROLLK;
+			else if (k == 1 && iscmd(next, "swap") && iscmd(third, "/"))
+				op->type = OP_INV;
+		} else if (op->type == OP_CMD) {
+			if (iscmd(op, "dup") && iscmd(next, "*"))
+				op->type = OP_SQUARE;
+			else if (iscmd(op, "swap") && iscmd(next, "-"))
+				op->type = OP_RSUB;
+			else if (iscmd(op, "swap") && iscmd(next, "/"))
+				op->type = OP_RDIV;
+			else {
+				size_t j;
+
+				for (j = 0; j < NUMINLINES; j++)
+					if (iscmd(op, inlines[j].name)) {
+						op->type = inlines[j].type;
+						break;
+					}
+			}
+		}
+	}
+	free(target);
+#endif
+}
+
+/*
+ * Compile str onto the end of c.  At the top level "." stands for the
+ * previous command word, and a control structure may go on over more
+ * than one line: compile() returns 1 while one is open, and the next
+ * call carries on with it, as it does when a line ends with a word such
+ * as map that is still waiting for its operand.  A NULL str ends the
+ * input.  Anywhere else a structure must be closed in the same str.  If
+ * one is not, or a word does not fit, everything compiled from the
+ * structure's first line on is replaced by an op that reports the word.
+ */
+int
+compile(char *str, struct code *c, int toplevel)
+{
+	static __thread char *word = NULL;
+	static __thread size_t wordroom = 0, start;
+	size_t x;
+	char *suffix, *w;
+	double num;
+	unsigned long long u;
+	int neg;
+
+	if (nctls == 0 && want == NULL)
+		start = c->n;
+	while (str != NULL && *str != '\0') {
 		while (isspace(*str))
 			str++;
 		if (*str == '\0')
 			break;
-		for (x = 0; *str != '\0' && !isspace(*str); x++)
-			word[x] = *str++;
+		for (x = 0; str[x] != '\0' && !isspace(str[x]); x++)
+			;
+		if (x >= wordroom) {
+			wordroom = x + 100;
+			if ((word = realloc(word, wordroom)) == NULL) {
+				perror("Error: realloc");
+				exit(1);
+			}
+		}
+		memcpy(word, str, x);
 		word[x] = '\0';
-		if ((suffix = strchr(word, BASECHAR)) != NULL) {
-			*suffix++ = '\0';
-                        tmp = tmp2 = word;
-                        while (*tmp2 != '\0') {
-                            if (*tmp2 == ',') tmp2++;
-                            else *tmp++ = *tmp2++;
-                        }
-                        *tmp++ = *tmp2++;
-			if (word[0] == '-')
-				pushnum(strtol(word, NULL, atoi(suffix)));
-			else
-				pushnum(strtoul(word, NULL, atoi(suffix)));
-		} else if (isnum(word)) {
-                        tmp = tmp2 = word;
-                        while (*tmp2 != '\0') {
-                            if (*tmp2 == ',') tmp2++;
-                            else *tmp++ = *tmp2++;
-                        }
-                        *tmp++ = *tmp2++;
-			if (isnotfloat(word)) {
-				if (word[0] == '-')
-					pushnum(strtol(word, &suffix, 0));
+		str += x;
+
+		if (wantvar) {
+			w = word;
+			if (isnum(w) || ctlword(c, w) != 0)
+				goto bad;
+			if ((ctls[nctls - 1].var = strdup(w)) == NULL) {
+				perror("Error: strdup");
+				exit(1);
+			}
+			wantvar = 0;
+			continue;
+		}
+		if (want != NULL) {
+			prefixed(c, want, word);
+			want = NULL;
+			continue;
+		}
+
+		for (w = word; *w != '\0'; w = suffix) {
+			if (lexnum(w, &num, &suffix)) {
+				if (fabs(num) >= MAXEXACT &&
+				    lexinteger(w, suffix, &u, &neg))
+					emit(c, neg ? OP_NEGINT : OP_INT)->u.word = u;
 				else
-					pushnum(strtoul(word, &suffix, 0));
-			} else
-				pushnum(strtod(word, &suffix));
-			if (*suffix != '\0')
-				process(suffix);
-		} else {
-			for (x = repeat, repeat = 1; x > 0; x--) {
-				eval(word);
-				if (stop) {
-					stop = 0;
-					return;
+					emit(c, OP_NUM)->u.num = num;
+				if (strchr(suffix, ',') != NULL) {
+					char *tmp, *tmp2;
+
+					for (tmp = tmp2 = suffix; *tmp2 != '\0'; tmp2++)
+						if (*tmp2 != ',')
+							*tmp++ = *tmp2;
+					*tmp = '\0';
+				}
+				continue;
+			}
+			switch (ctlword(c, w)) {
+			case -1:
+				goto bad;
+			case 1:
+				wantvar = strcmp(w, "for") == 0;
+				break;
+			default:
+				if ((want = isprefix(w)) != NULL)
+					break;
+				if (loopvar(c, w))
+					break;
+				if (toplevel) {
+					if (strcmp(w, ".") == 0 && prevcmd)
+						w = prevcmd;
+					else {
+						free(prevcmd);
+						prevcmd = strdup(w);
+					}
 				}
+				emitword(c, w);
+				break;
 			}
+			break;
 		}
 	}
+	if (nctls == 0 && want == NULL) {
+		fuse(c, start);
+		return 0;
+	}
+	if (toplevel && str != NULL)
+		return 1;
+	if (want != NULL)
+		w = want;
+	else if (ctls[nctls - 1].kind == CTL_LOOP &&
+	    (wantvar || ctls[nctls - 1].var))
+		w = "for";
+	else
+		w = ctlopen[ctls[nctls - 1].kind];
+
+bad:
+	for (x = start; x < c->n; x++)
+		if (HASNAME(c->ops[x].type))
+			free(c->ops[x].u.name);
+	c->n = start;
+	if ((emit(c, OP_BADCTL)->u.name = strdup(w)) == NULL) {
+		perror("Error: strdup");
+		exit(1);
+	}
+	while (nctls > 0)
+		popctl();
+	wantvar = 0;
+	want = NULL;
+	return 0;
+}
+
+/*
+ * Compile and run a line of input, or a NULL at the end of input.  A
+ * line that leaves a control structure open waits for the rest of it,
+ * and then process() returns 1.
+ */
+int
+process(char *str)
+{
+	static __thread struct code line;
+	static __thread int open;
+
+	if (!open)
+		freecode(&line);
+	if (!(open = compile(str, &line, 1)))
+		run(&line);
+	return open;
 }
 
-int isatty(int);
+struct metastack *
+newstack(struct metastack *next) {
+	struct metastack *m;
 
-static void
+	if ((m = malloc(sizeof *m)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	m->s = NULL;
+	m->d = m->room = 0;
+	m->n = next;
+	m->map = NULL;
+	m->maplen = 0;
+	m->fd = -1;
+	return m;
+}
+
+void
 pushstack(void) {
-	struct metastack *m = malloc(sizeof *m);
-	struct object *o = top();
-	m->n = M;
+	struct metastack *m = newstack(M);
 	M = m;
-	if(o)
-		pushnum(o->num);
+	if(M->n->d)
+		pushnum(M->n->s[M->n->d - 1]);
 }
 
-static void
+void
 freestack(struct metastack *m) {
-	struct object *o = NULL;
-	for(o = m->b; o; o = o->next)
-		free(o);
+	if (m->map != NULL)
+		munmap(m->map, m->maplen);
+	else
+		free(m->s);
+	if (m->fd >= 0)
+		close(m->fd);
 	free(m);
 }
 
-static void
+void
 popstack(void) {
-	struct object *o = top();
 	if(M->n) {
 		struct metastack *m = M;
 		M = M->n;
-		if(o)
-			pushnum(o->num);
+		if(m->d)
+			pushnum(m->s[m->d - 1]);
 
 		freestack(m);
 	}
 }
 
-static void
-init(void) {
-	struct command pushs = { "pushs", 0, pushstack },
-   	 	       pops = { "pops", 0, popstack };
-	addcommand(&pushs);
-	addcommand(&pops);
-	srand(time(NULL));
-	init_macros();
-	M = malloc(sizeof(*M));
-	M->t = NULL;
-	M->b = NULL;
-	M->d = 0;
-	M->n = NULL;
-}
-
-int
-main(int argc, char *argv[])
+/*
+ * Empty the stack, dropping any stacks pushed with pushs.
+ */
+void
+clearstack(void)
 {
-	init();
+	struct metastack *m;
 
-	if (argc > 1) {
-		int x;
-		for (x = 1; x < argc; x++)
-			process(argv[x]);
-		printstk("\n");
-	} else {
-		int interactive = isatty(0);
-		char buf[1000];
-		if (interactive)
-			printstk("> ");
-		while (fgets(buf, sizeof buf, stdin) != NULL) {
-			process(buf);
-			if (interactive)
-				printstk("> ");
-		}
-		if (!interactive)
-			printstk("\n");
+	while (M->n) {
+		m = M;
+		M = M->n;
+		freestack(m);
 	}
-
-	return 0;
+	M->d = 0;
 }
@@ -6,42 +6,217 @@
 
 #define MAXSIZE		10
 #define DEFBASE		10
+#define DEFDIGITS	12
 #define BASECHAR	'#'
+#define CHUNK		65536		/* values per chunk of a pool job */
+#define MAXTHREADS	256		/* most threads in the pool */
+#define MAXDEPTH	4000000		/* default limit on nested macro calls */
 
 #define ERR_DIVBYZERO	"Division by zero."
 #define ERR_DOMAIN	"Argument is outside of function domain."
 #define ERR_UNKNOWNCMD	"Unknown command."
 #define ERR_ARGC	"Too few arguments."
+#define ERR_NOTNUM	"Not a number."
+#define ERR_CONTROL	"Unbalanced control structure."
+#define ERR_DEPTH	"Macros nested too deeply."
+#define ERR_NOPROFILE	"Not built with -DPROFILE."
+#define ERR_NOTSTACK	"Not a stack file."
+#define ERR_SHARED	"Shared by the whole process; not allowed here."
+#define ERR_NOTWORD	"Not available in word mode."
 
+/*
+ * The operand stack is a contiguous array: s[0] is the bottom element
+ * and s[d - 1] the top.  It only ever grows, so pushes and pops do not
+ * touch the allocator once the stack has reached its working size.
+ * A stack loaded from a file may instead live in a mapping of maplen
+ * bytes at map, which is given up for the allocator when it outgrows it.
+ * A stack over the memory limit lives in a mapping of the file fd.
+ */
 struct metastack {
-	struct object *t;
-	struct object *b;
-	struct metastack *n;
+	double *s;
 	size_t d;
+	size_t room;
+	struct metastack *n;
+	void *map;
+	size_t maplen;
+	int fd;			/* spill file, or -1 */
 };
 
-struct object {
-	double num;
-	struct object *prev, *next;
+#define TOP		(M->s[M->d - 1])
+#define NTH(n)		(M->s[M->d - 1 - (n)])	/* NTH(0) is TOP */
+
+/*
+ * Built with -DPROFILE, eval() counts the calls, errors and time of
+ * every command and macro it runs; the stats command prints them.
+ * Self time leaves out the commands and macros run from inside.
+ */
+struct prof {
+	unsigned long calls, errors;
+	unsigned long long total, self;		/* nanoseconds */
 };
 
 struct command {
 	char *name;
 	long numargs;
 	void (*function)(void);
+	void (*word)(void);	/* in word mode; set up by word.c */
+#ifdef PROFILE
+	struct prof prof;
+#endif
 };
 
+/*
+ * Macro bodies and input lines are compiled into an array of ops with
+ * every word already resolved, so running them needs no tokenizing or
+ * table lookups.
+ */
+#define OP_NUM		0	/* push u.num */
+#define OP_CMD		1	/* run u.cmd */
+#define OP_MACRO	2	/* run u.macro */
+#define OP_UNKNOWN	3	/* report u.name as an unknown command */
+#define OP_BADCTL	4	/* report u.name as out of place */
+
+/*
+ * Control flow.  Jumps go to the op u.to ops away.  if, while and until
+ * pop a condition and jump when it is zero; start and for begin a loop,
+ * and next and step jump back to its body until it is done.
+ */
+#define OP_JMP		5
+#define OP_IF		6
+#define OP_WHILE	7
+#define OP_UNTIL	8
+#define OP_START	9	/* lower upper start */
+#define OP_FOR		10	/* lower upper for var */
+#define OP_NEXT		11
+#define OP_STEP		12	/* n step */
+#define OP_LOOPVAR	13	/* push the counter of the loop u.to loops out */
+
+/*
+ * Inline and fused ops, made by fuse() from the ops above.  They keep
+ * the union of the op they replace and the ops they cover follow them,
+ * so when their fast path cannot be taken the first op runs as it was
+ * compiled.  OP_ADD to OP_RDIV replace a command and OP_ADDK to OP_INV
+ * a number.  The comment gives the words each one stands for.
+ */
+#define OP_ADD		14	/* + */
+#define OP_SUB		15	/* - */
+#define OP_MUL		16	/* * */
+#define OP_DIV		17	/* / */
+#define OP_DUP		18	/* dup */
+#define OP_SWAP		19	/* swap */
+#define OP_DROP		20	/* drop */
+#define OP_INC		21	/* ++ */
+#define OP_DEC		22	/* -- */
+#define OP_SQUARE	23	/* dup * */
+#define OP_RSUB		24	/* swap - */
+#define OP_RDIV		25	/* swap / */
+#define OP_ADDK		26	/* k + */
+#define OP_SUBK		27	/* k - */
+#define OP_MULK		28	/* k * */
+#define OP_DIVK		29	/* k / */
+#define OP_POWK		30	/* k pow */
+#define OP_PICKK	31	/* k pick */
+#define OP_ROLLK	32	/* k roll */
+#define OP_INV		33	/* 1 swap / */
+
+#define OP_MAP		34	/* map u.macro */
+#define OP_MAPCMD	35	/* map u.cmd */
+#define OP_SAVE		36	/* save u.name */
+#define OP_LOAD		37	/* load u.name */
+
+/*
+ * Integer literals past 2^53, which word mode needs exactly.  Numbers
+ * of any other kind are OP_NUM.
+ */
+#define OP_INT		38	/* push the integer u.word */
+#define OP_NEGINT	39	/* push minus the integer u.word */
+#define NUMOPS		40
+
+struct op {
+	int type;
+	union {
+		double num;
+		unsigned long long word;
+		struct command *cmd;
+		struct macro *macro;
+		char *name;
+		long to;
+	} u;
+};
+
+struct code {
+	struct op *ops;
+	size_t n, room;
+};
+
+/*
+ * code is compiled from operation on first use and is stale once gen
+ * no longer matches macrogen, which changes whenever a macro or command
+ * is defined.
+ */
 struct macro {
 	char *name, *operation;
+	struct code code;
+	unsigned long gen;
+	int leaf;		/* code is one inline or fused op */
 	struct macro *prev, *next;
+#ifdef PROFILE
+	struct prof prof;
+#endif
 };
 
+/*
+ * The count, mean, sums of squared and cubed deviations from the mean,
+ * and least and greatest values of a set of numbers, as the one-pass
+ * statistics commands keep them.
+ */
+struct moments {
+	double n, mean, m2, m3, min, max;
+};
+
+struct stat;
+
 void addcommand(struct command *c);
-struct object *top(void);
-char *findmacro(char *);
+struct macro *findmacro(char *);
+void compilemacro(struct macro *);
+int compile(char *, struct code *, int), isleaf(struct code *);
+void resetcompile(void);
+void freecode(struct code *);
 double popnum(void);
-struct object *pop(void);
 struct command *findcmd(char *);
-void popobj(struct object *), pushnum(double), init_macros(void), error(char *);
+void pushnum(double), init_macros(void), error(char *);
+int loadmacros(char *, int);
+void addmacro(char *, char *);
+int readcache(char *);
+void writecache(char *, struct stat *, char **, size_t);
+void growstack(void);
+int process(char *);
+void printstk(char *), run(struct code *);
+int parsenum(char *, double *);
+unsigned long records(struct code *, FILE *, int);
+unsigned long column(int, FILE *, struct moments *);
+unsigned long table(struct code *, int, int, FILE *, unsigned long *);
+void compilemacros(void);
+void profileerror(void), dumpstats(void);
+int bigjob(size_t);
+void poolrun(size_t, void (*)(void *, size_t), void *);
+void map(struct op *);
+size_t batch(struct code *, int, const double *const *, int,
+    double *const *, size_t);
+int batchlanes(struct code *, int);
+int batchwidth(struct code *, int, const double *);
+void moments(struct moments *, const double *, size_t);
+void addmoments(struct moments *, const struct moments *);
+void pushmoments(struct moments *);
+struct metastack *newstack(struct metastack *);
+void pushstack(void), popstack(void), clearstack(void);
+void freestack(struct metastack *), trimstack(void);
+void dropvalues(const double *, size_t);
+double wordtonum(double), numtoword(double), savedword(double, int);
+double intcell(unsigned long long, int);
+int worddigits(double, int, unsigned long *);
+void wordeval(struct command *, long), setword(int, int);
+int savestack(char *), loadstack(char *, int);
+int serve(char *, int), client(char *, char *);
 unsigned countstack(void);
 double peeknthnum(unsigned off);
@@ -0,0 +1,359 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+/*
+ * rpn --serve and rpn --client: one resident rpn on a Unix socket.
+ *
+ * The server accepts connections on the main thread and hands them to a
+ * fixed set of worker threads, each serving one connection at a time
+ * with a stack and settings of its own.  A client sends lines and gets
+ * one line back for each: the stack, or the error if the line failed,
+ * as with -e, where the first error ends the line.  A line that leaves
+ * a control structure open gets its answer when the structure is
+ * closed.  Clients may send any number of lines before reading; a
+ * worker runs every whole line it has read and then writes all their
+ * answers at once.  quit closes the connection.  Connections beyond the
+ * number of workers wait for one to be free.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "rpn.h"
+
+#define READSIZE	65536
+
+extern __thread struct metastack *M;
+extern __thread FILE *outfp;
+extern __thread int base, stop, stackmode, padcount, digits, repeat;
+extern __thread int serving, quitting, wordsize, wordsigned, abandon;
+extern __thread size_t maxdepth, memlimit;
+extern size_t defmemlimit;
+extern __thread unsigned long nerrors;
+
+static char *sockpath;
+static ino_t sockino;
+
+/*
+ * Accepted connections waiting for a worker.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	int *fds;
+	size_t head, n, room;
+} queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void
+enqueue(int fd)
+{
+	size_t i;
+	int *fds;
+
+	pthread_mutex_lock(&queue.lock);
+	if (queue.n == queue.room) {
+		if ((fds = malloc((queue.room ? queue.room * 2 : 64) *
+		    sizeof *fds)) == NULL) {
+			perror("Error: malloc");
+			exit(1);
+		}
+		for (i = 0; i < queue.n; i++)
+			fds[i] = queue.fds[(queue.head + i) % queue.room];
+		free(queue.fds);
+		queue.fds = fds;
+		queue.head = 0;
+		queue.room = queue.room ? queue.room * 2 : 64;
+	}
+	queue.fds[(queue.head + queue.n++) % queue.room] = fd;
+	pthread_cond_signal(&queue.ready);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+static int
+dequeue(void)
+{
+	int fd;
+
+	pthread_mutex_lock(&queue.lock);
+	while (queue.n == 0)
+		pthread_cond_wait(&queue.ready, &queue.lock);
+	fd = queue.fds[queue.head];
+	queue.head = (queue.head + 1) % queue.room;
+	queue.n--;
+	pthread_mutex_unlock(&queue.lock);
+	return fd;
+}
+
+/*
+ * Run one line from the client and answer it once it is complete, or
+ * with a NULL line, finish any control structure left open.
+ */
+static void
+answer(char *line)
+{
+	static __thread unsigned long errs;
+	static __thread int open;
+
+	if (line == NULL && !open)
+		return;
+	if (!open)
+		errs = nerrors;
+	if ((open = process(line)) != 0)
+		return;
+	if (nerrors == errs && !quitting)
+		printstk("\n");
+}
+
+/*
+ * Serve the client on fd until it is done or quits, starting from the
+ * state a new rpn starts in.
+ */
+static void
+converse(int fd)
+{
+	char *buf, *line, *nl;
+	size_t room = READSIZE, have = 0;
+	ssize_t n;
+
+	if ((outfp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		return;
+	}
+	if ((buf = malloc(room)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	M = newstack(NULL);
+	base = DEFBASE;
+	digits = DEFDIGITS;
+	stackmode = padcount = stop = quitting = wordsize = 0;
+	repeat = wordsigned = 1;
+	maxdepth = MAXDEPTH;
+	memlimit = defmemlimit;
+	resetcompile();
+
+	while (!quitting) {
+		if (have + 1 >= room) {
+			room *= 2;
+			if ((buf = realloc(buf, room)) == NULL) {
+				perror("Error: realloc");
+				exit(1);
+			}
+		}
+		if ((n = read(fd, buf + have, room - have - 1)) < 0 &&
+		    errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		have += n;
+		for (line = buf; !quitting &&
+		    (nl = memchr(line, '\n', buf + have - line)) != NULL;
+		    line = nl + 1) {
+			*nl = '\0';
+			answer(line);
+		}
+		have -= line - buf;
+		memmove(buf, line, have);
+		if (fflush(outfp) == EOF)
+			break;
+	}
+	if (have > 0 && !quitting) {
+		buf[have] = '\0';
+		answer(buf);
+	}
+	answer(NULL);
+	free(buf);
+	fclose(outfp);
+	clearstack();
+	freestack(M);
+}
+
+static void *
+worker(void *arg)
+{
+	(void)arg;
+	serving = abandon = 1;
+	for (;;)
+		converse(dequeue());
+	return NULL;
+}
+
+static void
+stopserver(int sig)
+{
+	struct stat st;
+
+	(void)sig;
+	if (lstat(sockpath, &st) == 0 && st.st_ino == sockino)
+		unlink(sockpath);
+	_exit(0);
+}
+
+static int
+address(char *path, struct sockaddr_un *sa)
+{
+	memset(sa, 0, sizeof *sa);
+	sa->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof sa->sun_path) {
+		fprintf(stderr, "rpn: %s: socket path too long\n", path);
+		return 0;
+	}
+	strcpy(sa->sun_path, path);
+	return 1;
+}
+
+/*
+ * Serve clients on the socket path with workers threads, or one for
+ * each CPU if workers is 0.  Runs until killed.
+ */
+int
+serve(char *path, int workers)
+{
+	struct sockaddr_un sa;
+	struct stat st;
+	pthread_t tid;
+	int s, fd, i;
+
+	if (!address(path, &sa))
+		return 1;
+	if (workers < 1 && (workers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		workers = 1;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    bind(s, (struct sockaddr *)&sa, sizeof sa) < 0 ||
+	    listen(s, SOMAXCONN) < 0 || lstat(path, &st) < 0) {
+		perror(path);
+		return 1;
+	}
+	sockpath = path;
+	sockino = st.st_ino;
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, stopserver);
+	signal(SIGTERM, stopserver);
+	signal(SIGHUP, stopserver);
+
+	compilemacros();
+	for (i = 0; i < workers; i++) {
+		if (pthread_create(&tid, NULL, worker, NULL) != 0) {
+			perror("Error: pthread_create");
+			exit(1);
+		}
+		pthread_detach(tid);
+	}
+	for (;;) {
+		if ((fd = accept(s, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("Error: accept");
+			return 1;
+		}
+		enqueue(fd);
+	}
+}
+
+static int
+writeall(int fd, const char *p, size_t n)
+{
+	ssize_t w;
+
+	while (n > 0) {
+		if ((w = write(fd, p, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		p += w;
+		n -= w;
+	}
+	return 1;
+}
+
+/*
+ * Send the server on the socket path line, or all of standard input if
+ * line is NULL, and copy what comes back to standard output.  Input is
+ * sent as fast as the server takes it, without waiting for answers.
+ */
+int
+client(char *path, char *line)
+{
+	struct sockaddr_un sa;
+	struct pollfd p[2];
+	char out[READSIZE], *in;
+	size_t inlen = 0, inoff = 0;
+	ssize_t n;
+	int s, ineof = 0, shut = 0;
+
+	if (!address(path, &sa))
+		return 1;
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    connect(s, (struct sockaddr *)&sa, sizeof sa) < 0) {
+		perror(path);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if (line != NULL) {
+		in = line;
+		inlen = strlen(line);
+		ineof = 1;
+	} else if ((in = malloc(READSIZE)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+
+	for (;;) {
+		if (ineof && inoff == inlen && !shut) {
+			shutdown(s, SHUT_WR);
+			shut = 1;
+		}
+		p[0].fd = ineof || inoff < inlen ? -1 : 0;
+		p[0].events = POLLIN;
+		p[1].fd = s;
+		p[1].events = POLLIN | (inoff < inlen ? POLLOUT : 0);
+		if (poll(p, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error: poll");
+			return 1;
+		}
+		if (p[0].revents) {
+			if ((n = read(0, in, READSIZE)) <= 0)
+				ineof = 1;
+			else {
+				inlen = n;
+				inoff = 0;
+			}
+		}
+		if (p[1].revents & POLLOUT) {
+			if ((n = send(s, in + inoff, inlen - inoff,
+			    MSG_DONTWAIT)) >= 0)
+				inoff += n;
+			else if (errno != EAGAIN && errno != EINTR) {
+				ineof = 1;
+				inoff = inlen;
+			}
+		}
+		if (p[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+			if ((n = recv(s, out, sizeof out, MSG_DONTWAIT)) == 0)
+				return 0;
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				perror(path);
+				return 1;
+			}
+			if (!writeall(1, out, n))
+				return 1;
+		}
+	}
+}
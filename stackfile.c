@@ -0,0 +1,216 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+/*
+ * save FILE and load FILE: the stack in a binary file.
+ *
+ * A stack file is a struct header followed by the values as packed
+ * native doubles, bottom first, or in word mode the words' 64 bits, with
+ * the word size and signedness in the header.  load maps the file rather
+ * than reading it, so a big stack appears without being parsed or
+ * copied: onto an empty stack the mapping becomes the stack itself,
+ * copy-on-write, with some anonymous room after it to push onto.  Onto a
+ * stack that is not empty the values are copied from the mapping.  save
+ * writes a new file next to FILE in large writes straight from the stack
+ * and renames it over FILE, so a stack loaded from FILE is not pulled
+ * from under itself.  Loaded values are converted to the current mode as
+ * n word would convert them, unless the mode is taken from the file.
+ * Files from before words were saved have the shorter header of
+ * version 1.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "rpn.h"
+
+#define MAGIC		"rpnstack"
+#define FILEVERSION	2
+#define WRITESIZE	(1 << 24)	/* bytes per write() */
+#define EXTRAROOM	65536		/* values to push onto a loaded stack */
+
+extern __thread struct metastack *M;
+extern __thread char *thiscmd;
+extern __thread int wordsize, wordsigned;
+
+struct header {
+	char magic[8];
+	uint32_t version, size;		/* size of the header */
+	uint64_t n;			/* values that follow */
+	double one;			/* 1.0, to catch other byte orders */
+	uint32_t wordsize, wordsigned;	/* words of wordsize bits, or 0 */
+};
+#define OLDSIZE	offsetof(struct header, wordsize)	/* version 1 */
+
+static int
+fail(char *path, char *msg)
+{
+	thiscmd = path;
+	error(msg);
+	return 0;
+}
+
+static int
+writeall(int fd, const char *p, size_t n)
+{
+	ssize_t w;
+
+	while (n > 0) {
+		if ((w = write(fd, p, n < WRITESIZE ? n : WRITESIZE)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		p += w;
+		n -= w;
+	}
+	return 1;
+}
+
+/*
+ * Write the stack to path.  Returns 0 after reporting an error.
+ */
+int
+savestack(char *path)
+{
+	struct header h;
+	char *tmp;
+	mode_t mask;
+	int fd, ok;
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, MAGIC, sizeof h.magic);
+	h.version = FILEVERSION;
+	h.size = sizeof h;
+	h.n = M->d;
+	h.one = 1.0;
+	h.wordsize = wordsize;
+	h.wordsigned = wordsize != 0 && wordsigned;
+
+	if ((tmp = malloc(strlen(path) + 8)) == NULL) {
+		perror("Error: malloc");
+		exit(1);
+	}
+	sprintf(tmp, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) < 0) {
+		free(tmp);
+		return fail(path, strerror(errno));
+	}
+	mask = umask(0);
+	umask(mask);
+	ok = fchmod(fd, 0666 & ~mask) == 0 &&
+	    writeall(fd, (char *)&h, sizeof h) &&
+	    writeall(fd, (char *)M->s, M->d * sizeof *M->s);
+	if (close(fd) < 0)
+		ok = 0;
+	if (!ok || rename(tmp, path) < 0) {
+		ok = errno;
+		unlink(tmp);
+		free(tmp);
+		return fail(path, strerror(ok));
+	}
+	free(tmp);
+	return 1;
+}
+
+/*
+ * Push the values saved in path, switching first to the mode they were
+ * saved in if takemode is set.  Returns 0 after reporting an error.
+ */
+int
+loadstack(char *path, int takemode)
+{
+	struct header *h;
+	struct stat st;
+	size_t len, room, hsize, d = M->d;
+	uint32_t size = 0, sign = 0;
+	char *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return fail(path, strerror(errno));
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return fail(path, strerror(errno));
+	}
+	if ((size_t)st.st_size < OLDSIZE) {
+		close(fd);
+		return fail(path, ERR_NOTSTACK);
+	}
+	len = st.st_size;
+
+	/*
+	 * Reserve room for the file and EXTRAROOM more values, and map the
+	 * file over the start of it.
+	 */
+	room = (len - OLDSIZE) / sizeof *M->s + EXTRAROOM;
+	if ((map = mmap(NULL, sizeof *h + room * sizeof *M->s,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) ==
+	    MAP_FAILED ||
+	    mmap(map, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+	    fd, 0) == MAP_FAILED) {
+		if (map != MAP_FAILED)
+			munmap(map, sizeof *h + room * sizeof *M->s);
+		close(fd);
+		return fail(path, strerror(errno));
+	}
+	close(fd);
+
+	h = (struct header *)map;
+	hsize = h->version == 1 ? OLDSIZE : sizeof *h;
+	if (h->version == FILEVERSION && len >= sizeof *h) {
+		size = h->wordsize;
+		sign = h->wordsigned;
+	}
+	if (memcmp(h->magic, MAGIC, sizeof h->magic) != 0 ||
+	    (h->version != 1 && h->version != FILEVERSION) ||
+	    h->size != hsize || len < hsize || h->one != 1.0 ||
+	    h->n != (len - hsize) / sizeof *M->s ||
+	    (len - hsize) % sizeof *M->s != 0 ||
+	    (size != 0 && size != 8 && size != 16 && size != 32 &&
+	    size != 64) || sign > 1) {
+		munmap(map, sizeof *h + room * sizeof *M->s);
+		return fail(path, ERR_NOTSTACK);
+	}
+	if (takemode)
+		setword(size, size == 0 || sign);
+
+	if (M->d == 0) {
+		if (M->map != NULL)
+			munmap(M->map, M->maplen);
+		else
+			free(M->s);
+		if (M->fd >= 0) {
+			close(M->fd);
+			M->fd = -1;
+		}
+		M->map = map;
+		M->maplen = sizeof *h + room * sizeof *M->s;
+		M->s = (double *)(map + hsize);
+		M->d = h->n;
+		M->room = room;
+	} else {
+		while (M->room < M->d + h->n)
+			growstack();
+		memcpy(&M->s[M->d], map + hsize, h->n * sizeof *M->s);
+		M->d += h->n;
+		munmap(map, sizeof *h + room * sizeof *M->s);
+	}
+	if (size != 0 && (size != (uint32_t)wordsize ||
+	    sign != (uint32_t)wordsigned))
+		for (; d < M->d; d++)
+			M->s[d] = savedword(M->s[d], sign);
+	else if (size == 0 && wordsize != 0)
+		for (; d < M->d; d++)
+			M->s[d] = numtoword(M->s[d]);
+	return 1;
+}
@@ -0,0 +1,459 @@
+/*
+ * rpn - Mycroft <mycroft@datasphere.net>
+ */
+
+/*
+ * Integer word mode: n word and n uword.
+ *
+ * In word mode every value on the stack is an integer of wordsize bits,
+ * signed or not, held exactly in the eight bytes a number takes, cut to
+ * the word size and sign- or zero-extended to 64 bits.  Commands that
+ * move values around, such as dup, swap and roll, copy the bytes as
+ * they are.  Arithmetic, comparisons, the bitwise commands, shifts and
+ * popcount have versions here that work on the integers directly and
+ * wrap as the word would, and so do sum, sumn, prod, smin and smax.
+ * sort, rsort, median, nth and pct order the words themselves; see
+ * cmd.c.  Any other command runs on its arguments turned into numbers,
+ * and what it leaves is turned back into words, truncated and wrapped;
+ * integers past 2^53 do not survive that.  The rest of the commands
+ * that use the whole stack, such as mean and describe, are refused
+ * rather than have them do that to every value.  Changing the mode
+ * converts every stack, so 0 word goes back to floating point.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "rpn.h"
+
+__thread int wordsize = 0;	/* bits, or 0 for floating point */
+__thread int wordsigned = 1;
+
+extern __thread struct metastack *M;
+extern __thread int stop;
+
+static __thread struct command *thiscommand;
+static __thread long thisnumargs;
+
+static uint64_t
+bits(double cell)
+{
+	uint64_t u;
+
+	memcpy(&u, &cell, sizeof u);
+	return u;
+}
+
+/*
+ * u cut to the word size, as it is kept on the stack.
+ */
+static uint64_t
+trim(uint64_t u)
+{
+	if (wordsize < 64) {
+		u &= ((uint64_t)1 << wordsize) - 1;
+		if (wordsigned && u >> (wordsize - 1))
+			u |= ~(uint64_t)0 << wordsize;
+	}
+	return u;
+}
+
+static double
+cell(uint64_t u)
+{
+	double c;
+
+	u = trim(u);
+	memcpy(&c, &u, sizeof c);
+	return c;
+}
+
+/*
+ * The number a word stands for, and the word for a number.  Numbers
+ * are truncated and wrap around; nan is 0.
+ */
+double
+wordtonum(double w)
+{
+	return wordsigned ? (double)(int64_t)bits(w) : (double)bits(w);
+}
+
+double
+numtoword(double num)
+{
+	num = trunc(num);
+	if (fabs(num) >= 18446744073709551616.0)	/* 2^64 */
+		num = fmod(num, 18446744073709551616.0);
+	if (isnan(num))
+		return cell(0);
+	return cell(num < 0 ? -(uint64_t)-num : (uint64_t)num);
+}
+
+/*
+ * The value in the current mode for the word w, saved from a stack of
+ * words signed or not: its low bits as setword() keeps them, or the
+ * number it stands for.
+ */
+double
+savedword(double w, int sign)
+{
+	if (wordsize != 0)
+		return cell(bits(w));
+	return sign ? (double)(int64_t)bits(w) : (double)bits(w);
+}
+
+/*
+ * What an integer literal of magnitude u pushes, in either mode.
+ */
+double
+intcell(unsigned long long u, int neg)
+{
+	if (wordsize != 0)
+		return cell(neg ? -(uint64_t)u : u);
+	return neg ? -(double)u : (double)u;
+}
+
+/*
+ * The digits printnum() shows for the word w: in decimal, its value
+ * with the sign returned separately, and in other bases its bits
+ * within the word size.
+ */
+int
+worddigits(double w, int base, unsigned long *u)
+{
+	uint64_t v = bits(w);
+
+	if (base == 10 && wordsigned && (int64_t)v < 0) {
+		*u = -v;
+		return 1;
+	}
+	*u = wordsize < 64 ? v & (((uint64_t)1 << wordsize) - 1) : v;
+	return 0;
+}
+
+/*
+ * Is the word w negative?  Comparisons, min, max, abs and sign go by
+ * this and by lt().
+ */
+#define NEG(w)	(wordsigned && (int64_t)(w) < 0)
+
+static int
+lt(uint64_t x, uint64_t y)
+{
+	return wordsigned ? (int64_t)x < (int64_t)y : x < y;
+}
+
+#define X	bits(NTH(1))
+#define Y	bits(TOP)
+
+/* replace the top two values with u */
+#define RESULT2(u)	do {						\
+				NTH(1) = cell(u);			\
+				M->d--;					\
+			} while (0)
+
+static void w_not(void) { TOP = cell(Y == 0); }
+static void w_ne(void) { RESULT2(X != Y); }
+static void w_eq(void) { RESULT2(X == Y); }
+static void w_lt(void) { RESULT2(lt(X, Y)); }
+static void w_le(void) { RESULT2(!lt(Y, X)); }
+static void w_gt(void) { RESULT2(lt(Y, X)); }
+static void w_ge(void) { RESULT2(!lt(X, Y)); }
+static void w_and(void) { RESULT2(X && Y); }
+static void w_or(void) { RESULT2(X || Y); }
+static void w_add(void) { RESULT2(X + Y); }
+static void w_sub(void) { RESULT2(X - Y); }
+static void w_mul(void) { RESULT2(X * Y); }
+static void w_inc(void) { TOP = cell(Y + 1); }
+static void w_dec(void) { TOP = cell(Y - 1); }
+static void w_bitand(void) { RESULT2(X & Y); }
+static void w_bitor(void) { RESULT2(X | Y); }
+static void w_bitxor(void) { RESULT2(X ^ Y); }
+static void w_bitcmpl(void) { TOP = cell(~Y); }
+static void w_same(void) { }
+static void w_zero(void) { TOP = cell(0); }
+
+/*
+ * Division truncates toward zero and % takes the sign of the dividend,
+ * as in C.  The one quotient too big for a signed word wraps.
+ */
+static void
+w_div(void)
+{
+	uint64_t x = X, y = Y;
+
+	if (y == 0)
+		error(ERR_DIVBYZERO);
+	else if (!wordsigned)
+		RESULT2(x / y);
+	else if (y == (uint64_t)-1)
+		RESULT2(-x);
+	else
+		RESULT2((int64_t)x / (int64_t)y);
+}
+
+static void
+w_mod(void)
+{
+	uint64_t x = X, y = Y;
+
+	if (y == 0)
+		error(ERR_DIVBYZERO);
+	else if (!wordsigned)
+		RESULT2(x % y);
+	else if (y == (uint64_t)-1)
+		RESULT2(0);
+	else
+		RESULT2((int64_t)x % (int64_t)y);
+}
+
+/*
+ * A shift by the word size or more, or by a negative count, shifts
+ * everything out.  >> is arithmetic on signed words, so there it
+ * leaves the sign.
+ */
+static void
+w_shl(void)
+{
+	uint64_t y = Y;
+
+	RESULT2(NEG(y) || y >= (uint64_t)wordsize ? 0 : X << y);
+}
+
+static void
+w_shr(void)
+{
+	uint64_t x = X, y = Y;
+
+	if (wordsigned)
+		RESULT2((int64_t)x >> (NEG(y) || y >= (uint64_t)wordsize ?
+		    63 : y));
+	else
+		RESULT2(y >= (uint64_t)wordsize ? 0 : x >> y);
+}
+
+static void
+w_popcount(void)
+{
+	uint64_t u = Y;
+	int n;
+
+	if (wordsize < 64)
+		u &= ((uint64_t)1 << wordsize) - 1;
+	for (n = 0; u != 0; u &= u - 1)
+		n++;
+	TOP = cell(n);
+}
+
+static void
+w_abs(void)
+{
+	if (NEG(Y))
+		TOP = cell(-Y);
+}
+
+static void
+w_sign(void)
+{
+	TOP = cell(NEG(Y) ? (uint64_t)-1 : Y != 0);
+}
+
+static void
+w_max(void)
+{
+	uint64_t x = X, y = Y;
+
+	RESULT2(lt(x, y) ? y : x);
+}
+
+static void
+w_min(void)
+{
+	uint64_t x = X, y = Y;
+
+	RESULT2(lt(y, x) ? y : x);
+}
+
+/*
+ * Reductions over the stack from lo up, leaving one word at lo.  sumn
+ * of nothing leaves 0.
+ */
+#define RED_SUM		0
+#define RED_PROD	1
+#define RED_MAX		2
+#define RED_MIN		3
+
+static void
+reduce(int how, size_t lo)
+{
+	uint64_t v, u;
+	size_t i;
+
+	v = how == RED_SUM ? 0 : how == RED_PROD ? 1 : bits(M->s[lo]);
+	for (i = lo; i < M->d; i++) {
+		u = bits(M->s[i]);
+		switch (how) {
+		case RED_SUM:
+			v += u;
+			break;
+		case RED_PROD:
+			v *= u;
+			break;
+		case RED_MAX:
+			if (lt(v, u))
+				v = u;
+			break;
+		default:
+			if (lt(u, v))
+				v = u;
+		}
+	}
+	M->s[lo] = cell(v);
+	M->d = lo + 1;
+	trimstack();
+}
+
+static void w_sum(void) { reduce(RED_SUM, 0); }
+static void w_prod(void) { reduce(RED_PROD, 0); }
+static void w_smax(void) { reduce(RED_MAX, 0); }
+static void w_smin(void) { reduce(RED_MIN, 0); }
+
+static void
+w_sumn(void)
+{
+	size_t lo = M->d - thisnumargs;
+
+	M->d--;
+	reduce(RED_SUM, lo);
+}
+
+static void
+notword(void)
+{
+	error(ERR_NOTWORD);
+}
+
+/*
+ * The ways to run the commands without word versions, on the command
+ * wordeval() was given: withnum() on the words as they are but for the
+ * number on top, asis() on the words as they are, but with the count of
+ * those that take one as a number, and numbers() on its arguments as
+ * numbers.
+ */
+static void
+withnum(void)
+{
+	size_t d = M->d;
+
+	TOP = wordtonum(TOP);
+	thiscommand->function();
+	if (stop && M->d == d)
+		TOP = numtoword(TOP);
+}
+
+static void
+asis(void)
+{
+	if (thiscommand->numargs == -1)
+		withnum();
+	else
+		thiscommand->function();
+}
+
+static void
+numbers(void)
+{
+	size_t i, lo = M->d - thisnumargs;
+
+	for (i = lo; i < M->d; i++)
+		M->s[i] = wordtonum(M->s[i]);
+	thiscommand->function();
+	for (i = lo; i < M->d; i++)
+		M->s[i] = numtoword(M->s[i]);
+}
+
+static struct {
+	char *name;
+	void (*word)(void);
+} wordcmds[] = {
+	{ "!", w_not }, { "!=", w_ne }, { "%", w_mod }, { "&", w_bitand },
+	{ "&&", w_and }, { "*", w_mul }, { "+", w_add }, { "++", w_inc },
+	{ "-", w_sub }, { "--", w_dec }, { "/", w_div }, { "<", w_lt },
+	{ "<<", w_shl }, { "<=", w_le }, { "==", w_eq }, { ">", w_gt },
+	{ ">=", w_ge }, { ">>", w_shr }, { "^", w_bitxor }, { "|", w_bitor },
+	{ "||", w_or }, { "~", w_bitcmpl }, { "abs", w_abs },
+	{ "ceil", w_same }, { "floor", w_same }, { "fp", w_zero },
+	{ "ip", w_same }, { "max", w_max }, { "min", w_min },
+	{ "popcount", w_popcount }, { "prod", w_prod }, { "sign", w_sign },
+	{ "smax", w_smax }, { "smin", w_smin }, { "sum", w_sum },
+	{ "sumn", w_sumn },
+
+	{ "drop", asis }, { "dropn", asis }, { "dup", asis },
+	{ "dupn", asis }, { "help", asis }, { "median", asis },
+	{ "pick", asis }, { "pops", asis }, { "pushs", asis },
+	{ "roll", asis }, { "rolld", asis }, { "rsort", asis },
+	{ "sort", asis }, { "stack", asis }, { "stats", asis },
+	{ "swap", asis },
+
+	{ "nth", withnum }, { "pct", withnum },
+
+	{ "describe", notword }, { "hist", notword }, { "mean", notword },
+	{ "meann", notword }, { "sdev", notword }, { "skew", notword },
+	{ "var", notword }
+};
+#define NUMWORDCMDS (sizeof wordcmds / sizeof *wordcmds)
+
+static pthread_once_t wordonce = PTHREAD_ONCE_INIT;
+
+static void
+initwords(void)
+{
+	struct command *c;
+	size_t i;
+
+	for (i = 0; i < NUMWORDCMDS; i++)
+		if ((c = findcmd(wordcmds[i].name)) != NULL)
+			c->word = wordcmds[i].word;
+}
+
+/*
+ * Run the command c, which has its numargs arguments, in word mode.
+ */
+void
+wordeval(struct command *c, long numargs)
+{
+	thiscommand = c;
+	thisnumargs = numargs;
+	if (c->word != NULL)
+		c->word();
+	else
+		numbers();
+}
+
+/*
+ * Switch to words of size bits, signed or not, or to floating point if
+ * size is 0, converting every stack.  Words that change size keep as
+ * many of their low bits as fit.
+ */
+void
+setword(int size, int sign)
+{
+	struct metastack *m;
+	int old = wordsize;
+	size_t i;
+
+	pthread_once(&wordonce, initwords);
+	if (old != 0 && size == 0)
+		for (m = M; m != NULL; m = m->n)
+			for (i = 0; i < m->d; i++)
+				m->s[i] = wordtonum(m->s[i]);
+	wordsize = size;
+	wordsigned = sign;
+	if (size != 0)
+		for (m = M; m != NULL; m = m->n)
+			for (i = 0; i < m->d; i++)
+				m->s[i] = old != 0 ? cell(bits(m->s[i])) :
+				    numtoword(m->s[i]);
+}